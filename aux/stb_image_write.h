@@ -193,6 +193,15 @@ STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x,
 
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
+#if !defined(STBI_WRITE_NO_STDIO) && !defined(STBIW_ZLIB_COMPRESS)
+// PNG written a band of rows at a time, top row first (stbi_flip_vertically_on_write doesn't apply).
+// Only the band and the last 32K of filtered data are kept. end() returns 1 if the whole image was written
+typedef struct stbi_png_stream stbi_png_stream;
+STBIWDEF stbi_png_stream *stbi_write_png_begin(char const *filename, int w, int h, int comp);
+STBIWDEF int stbi_write_png_rows(stbi_png_stream *s, const void *rows, int count, int stride_in_bytes);
+STBIWDEF int stbi_write_png_end(stbi_png_stream *s);
+#endif
+
 #endif//INCLUDE_STB_IMAGE_WRITE_H
 
 #ifdef STB_IMAGE_WRITE_IMPLEMENTATION
@@ -879,33 +888,33 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #endif // STBIW_ZLIB_COMPRESS
 
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+#ifndef STBIW_ZLIB_COMPRESS
+// appends one fixed-huffman block for data[start..data_len) to the bit stream; matches may
+// reach back into data[0..start) (at most 32K back). hash_table must come in empty, and is left empty
+static unsigned char *stbiw__zlib_block(unsigned char *out, unsigned int *bitbufp, int *bitcountp, unsigned char ***hash_table,
+                                        unsigned char *data, int start, int data_len, int quality, int final)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
    static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
    static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
-   unsigned int bitbuf=0;
-   int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
-   if (hash_table == NULL)
-      return NULL;
-   if (quality < 5) quality = 5;
+   unsigned int bitbuf=*bitbufp;
+   int i,j, bitcount=*bitcountp;
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_add(final,1);  // BFINAL
    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      hash_table[i] = NULL;
+   // the data before start is only there to be matched against
+   for (i = start > 32768 ? start-32768 : 0; i < start && i < data_len-3; ++i) {
+      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1);
+      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
+         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
+         stbiw__sbn(hash_table[h]) = quality;
+      }
+      stbiw__sbpush(hash_table[h],data+i);
+   }
 
-   i=0;
+   i=start;
    while (i < data_len-3) {
       // hash next 3 bytes of data to be compressed
       int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
@@ -960,6 +969,50 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
    for (;i < data_len; ++i)
       stbiw__zlib_huffb(data[i]);
    stbiw__zlib_huff(256); // end of block
+
+   for (i=0; i < stbiw__ZHASH; ++i) // (keeping the memory for next time)
+      if (hash_table[i]) stbiw__sbn(hash_table[i]) = 0;
+   *bitbufp = bitbuf;
+   *bitcountp = bitcount;
+   return out;
+}
+
+static void stbiw__adler32(unsigned int *s1p, unsigned int *s2p, const unsigned char *data, int data_len)
+{
+   unsigned int s1=*s1p, s2=*s2p;
+   int i, j=0, blocklen = (int) (data_len % 5552);
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
+      s1 %= 65521; s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
+   }
+   *s1p = s1;
+   *s2p = s2;
+}
+#endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   unsigned int bitbuf=0;
+   int i, bitcount=0;
+   unsigned char *out = NULL;
+   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
+   if (hash_table == NULL)
+      return NULL;
+   if (quality < 5) quality = 5;
+
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+
+   for (i=0; i < stbiw__ZHASH; ++i)
+      hash_table[i] = NULL;
+
+   out = stbiw__zlib_block(out, &bitbuf, &bitcount, hash_table, data, 0, data_len, quality, 1);
    // pad with 0 bits to byte boundary
    while (bitcount)
       stbiw__zlib_add(0,1);
@@ -971,14 +1024,7 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
    {
       // compute adler32 on input
       unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
+      stbiw__adler32(&s1, &s2, data, data_len);
       stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
       stbiw__sbpush(out, STBIW_UCHAR(s2));
       stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
@@ -1059,15 +1105,15 @@ static unsigned char stbiw__paeth(int a, int b, int c)
 }
 
 // @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer, int flip)
 {
    static int mapping[] = { 0,1,2,3,4 };
    static int firstmap[] = { 0,1,0,5,6 };
    int *mymap = (y != 0) ? mapping : firstmap;
    int i;
    int type = mymap[filter_type];
-   unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
-   int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+   unsigned char *z = pixels + stride_bytes * (flip ? height-1-y : y);
+   int signed_stride = flip ? -stride_bytes : stride_bytes;
 
    if (type==0) {
       memcpy(line_buffer, z, width*n);
@@ -1095,11 +1141,58 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
    }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+// filters row j (counting from the bottom if flip) into line_buffer, with force_filter or the filter that looks best;
+// returns the filter type
+static int stbiw__filter_png_line(unsigned char *pixels, int stride_bytes, int x, int y, int j, int n, int force_filter, signed char *line_buffer, int flip)
+{
+   int filter_type;
+   if (force_filter > -1) {
+      filter_type = force_filter;
+      stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, force_filter, line_buffer, flip);
+   } else { // Estimate the best filter by running through all of them:
+      int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
+      for (filter_type = 0; filter_type < 5; filter_type++) {
+         stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, filter_type, line_buffer, flip);
+
+         // Estimate the entropy of the line using this filter; the less, the better.
+         est = 0;
+         for (i = 0; i < x*n; ++i) {
+            est += abs((signed char) line_buffer[i]);
+         }
+         if (est < best_filter_val) {
+            best_filter_val = est;
+            best_filter = filter_type;
+         }
+      }
+      if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
+         stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, best_filter, line_buffer, flip);
+         filter_type = best_filter;
+      }
+   }
+   return filter_type;
+}
+
+static unsigned char *stbiw__png_header(unsigned char *o, int x, int y, int n)
 {
-   int force_filter = stbi_write_force_png_filter;
    int ctype[5] = { -1, 0, 4, 2, 6 };
    unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   STBIW_MEMMOVE(o,sig,8); o+= 8;
+   stbiw__wp32(o, 13); // header length
+   stbiw__wptag(o, "IHDR");
+   stbiw__wp32(o, x);
+   stbiw__wp32(o, y);
+   *o++ = 8;
+   *o++ = STBIW_UCHAR(ctype[n]);
+   *o++ = 0;
+   *o++ = 0;
+   *o++ = 0;
+   stbiw__wpcrc(&o,13);
+   return o;
+}
+
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   int force_filter = stbi_write_force_png_filter;
    unsigned char *out,*o, *filt, *zlib;
    signed char *line_buffer;
    int j,zlen;
@@ -1114,30 +1207,7 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
    line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
    for (j=0; j < y; ++j) {
-      int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
-      } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
-         for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
-
-            // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
-            if (est < best_filter_val) {
-               best_filter_val = est;
-               best_filter = filter_type;
-            }
-         }
-         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
-            filter_type = best_filter;
-         }
-      }
+      int filter_type = stbiw__filter_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer, stbi__flip_vertically_on_write);
       // when we get here, filter_type contains the filter type, and line_buffer contains the data
       filt[j*(x*n+1)] = (unsigned char) filter_type;
       STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
@@ -1152,18 +1222,7 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    if (!out) return 0;
    *out_len = 8 + 12+13 + 12+zlen + 12;
 
-   o=out;
-   STBIW_MEMMOVE(o,sig,8); o+= 8;
-   stbiw__wp32(o, 13); // header length
-   stbiw__wptag(o, "IHDR");
-   stbiw__wp32(o, x);
-   stbiw__wp32(o, y);
-   *o++ = 8;
-   *o++ = STBIW_UCHAR(ctype[n]);
-   *o++ = 0;
-   *o++ = 0;
-   *o++ = 0;
-   stbiw__wpcrc(&o,13);
+   o = stbiw__png_header(out, x, y, n);
 
    stbiw__wp32(o, zlen);
    stbiw__wptag(o, "IDAT");
@@ -1198,6 +1257,152 @@ STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const
 }
 #endif
 
+#if !defined(STBI_WRITE_NO_STDIO) && !defined(STBIW_ZLIB_COMPRESS)
+struct stbi_png_stream
+{
+   FILE *f;
+   int x, y, n, rows_done, ok;
+   unsigned char *window;        // the last 32K of filtered data, then the rows being added
+   int window_len, window_size;  // (the first window_len bytes are the old data)
+   unsigned char *prev_row;      // two rows, for filtering against the row above
+   signed char *line_buffer;
+   unsigned char ***hash_table;
+   unsigned char *out;           // compressed bytes not written yet (stretchy buffer)
+   unsigned int bitbuf, s1, s2;
+   int bitcount;
+};
+
+static void stbiw__png_stream_flush(stbi_png_stream *s) // writes out the pending bytes as an IDAT chunk
+{
+   int len = stbiw__sbcount(s->out);
+   unsigned char *chunk, *o;
+   if (!len) return;
+   chunk = (unsigned char *) STBIW_MALLOC(len + 12);
+   if (!chunk) { s->ok = 0; return; }
+   o = chunk;
+   stbiw__wp32(o, len);
+   stbiw__wptag(o, "IDAT");
+   STBIW_MEMMOVE(o, s->out, len);
+   o += len;
+   stbiw__wpcrc(&o, len);
+   if (fwrite(chunk, 1, len + 12, s->f) != (size_t) (len + 12)) s->ok = 0;
+   STBIW_FREE(chunk);
+   stbiw__sbn(s->out) = 0;
+}
+
+STBIWDEF stbi_png_stream *stbi_write_png_begin(char const *filename, int x, int y, int comp)
+{
+   unsigned char header[8 + 12+13], *out = NULL;
+   int i;
+   stbi_png_stream *s = (stbi_png_stream *) STBIW_MALLOC(sizeof(stbi_png_stream));
+   if (!s) return NULL;
+   memset(s, 0, sizeof(*s));
+   s->x = x; s->y = y; s->n = comp;
+   s->ok = 1;
+   s->s1 = 1;
+   s->prev_row    = (unsigned char *) STBIW_MALLOC(2 * x * comp);
+   s->line_buffer = (signed char *) STBIW_MALLOC(x * comp);
+   s->hash_table  = (unsigned char ***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
+   if (s->hash_table)
+      for (i=0; i < stbiw__ZHASH; ++i)
+         s->hash_table[i] = NULL;
+   if (s->prev_row && s->line_buffer && s->hash_table)
+      s->f = stbiw__fopen(filename, "wb");
+   if (!s->f) {
+      stbi_write_png_end(s);
+      return NULL;
+   }
+   stbiw__png_header(header, x, y, comp);
+   if (fwrite(header, 1, sizeof(header), s->f) != sizeof(header)) s->ok = 0;
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   s->out = out;
+   return s;
+}
+
+STBIWDEF int stbi_write_png_rows(stbi_png_stream *s, const void *rows, int count, int stride_bytes)
+{
+   int force_filter = stbi_write_force_png_filter >= 5 ? -1 : stbi_write_force_png_filter;
+   int quality = stbi_write_png_compression_level < 5 ? 5 : stbi_write_png_compression_level;
+   int row_bytes = s->x * s->n, j, need;
+   const unsigned char *pixels = (const unsigned char *) rows;
+   if (!s->ok) return 0;
+   if (stride_bytes == 0)
+      stride_bytes = row_bytes;
+   if (count > s->y - s->rows_done)
+      count = s->y - s->rows_done;
+   if (count <= 0) return 1;
+
+   need = s->window_len + count * (row_bytes + 1);
+   if (need > s->window_size) {
+      unsigned char *w = (unsigned char *) STBIW_REALLOC_SIZED(s->window, s->window_size, need);
+      if (!w) { s->ok = 0; return 0; }
+      s->window = w;
+      s->window_size = need;
+   }
+
+   // filter each row, against the one above it (from the last call, for the first row)
+   for (j=0; j < count; ++j) {
+      unsigned char *f = s->window + s->window_len + j * (row_bytes + 1);
+      STBIW_MEMMOVE(s->prev_row + row_bytes, pixels + (size_t) j * stride_bytes, row_bytes);
+      if (s->rows_done + j) f[0] = (unsigned char) stbiw__filter_png_line(s->prev_row, row_bytes, s->x, 2, 1, s->n, force_filter, s->line_buffer, 0);
+      else f[0] = (unsigned char) stbiw__filter_png_line(s->prev_row + row_bytes, row_bytes, s->x, 1, 0, s->n, force_filter, s->line_buffer, 0);
+      STBIW_MEMMOVE(f+1, s->line_buffer, row_bytes);
+      STBIW_MEMMOVE(s->prev_row, s->prev_row + row_bytes, row_bytes);
+   }
+   s->rows_done += count;
+
+   // compress them as a block of their own, which can still match against the 32K before it
+   stbiw__adler32(&s->s1, &s->s2, s->window + s->window_len, need - s->window_len);
+   s->out = stbiw__zlib_block(s->out, &s->bitbuf, &s->bitcount, s->hash_table, s->window, s->window_len, need, quality, 0);
+   stbiw__png_stream_flush(s);
+   s->window_len = need < 32768 ? need : 32768;
+   STBIW_MEMMOVE(s->window, s->window + need - s->window_len, s->window_len);
+   return s->ok;
+}
+
+STBIWDEF int stbi_write_png_end(stbi_png_stream *s)
+{
+   int ok, i;
+   if (!s) return 0;
+   if (s->f) {
+      unsigned char *out = s->out;
+      unsigned int bitbuf = s->bitbuf;
+      int bitcount = s->bitcount;
+      unsigned char iend[12], *o = iend;
+      // an empty final block, then the checksum
+      stbiw__zlib_add(1,1);  // BFINAL = 1
+      stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+      stbiw__zlib_huff(256);
+      while (bitcount)
+         stbiw__zlib_add(0,1);
+      stbiw__sbpush(out, STBIW_UCHAR(s->s2 >> 8));
+      stbiw__sbpush(out, STBIW_UCHAR(s->s2));
+      stbiw__sbpush(out, STBIW_UCHAR(s->s1 >> 8));
+      stbiw__sbpush(out, STBIW_UCHAR(s->s1));
+      s->out = out;
+      stbiw__png_stream_flush(s);
+      stbiw__wp32(o,0);
+      stbiw__wptag(o, "IEND");
+      stbiw__wpcrc(&o,0);
+      if (fwrite(iend, 1, 12, s->f) != 12) s->ok = 0;
+      if (fclose(s->f)) s->ok = 0;
+   }
+   ok = s->f && s->ok && s->rows_done == s->y;
+   if (s->hash_table) {
+      for (i=0; i < stbiw__ZHASH; ++i)
+         (void) stbiw__sbfree(s->hash_table[i]);
+      STBIW_FREE(s->hash_table);
+   }
+   (void) stbiw__sbfree(s->out);
+   STBIW_FREE(s->window);
+   STBIW_FREE(s->prev_row);
+   STBIW_FREE(s->line_buffer);
+   STBIW_FREE(s);
+   return ok;
+}
+#endif
+
 STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
 {
    int len;
@@ -5,7 +5,7 @@
  --
 
  To compile this:
-    gcc fixpaper.c -o fixpaper -ffast-math -Ofast -lGL -lglut -lm -std=gnu99
+    gcc fixpaper.c -o fixpaper -ffast-math -Ofast -lGL -lglut -lm -lpthread -std=gnu99
 
 
  Copyright 2021, Elie Goldman Smith
@@ -24,11 +24,22 @@
  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 ***/
 
+#define GL_GLEXT_PROTOTYPES // for the shader functions
 #include <GL/gl.h>
 #include <GL/glut.h>
+#include <GL/glx.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "aux/stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -39,7 +50,7 @@ typedef struct {
  float y;
 } vec2;
 
-#define isFloatNonzeroEnough(f) ((f) < -0.000001f || 0.000001f < (f))
+typedef struct moment_tables moment_tables;
 
 #define DEFAULT_WINDOW_WIDTH  640
 #define DEFAULT_WINDOW_HEIGHT 360
@@ -47,11 +58,16 @@ int _viewport_x = DEFAULT_WINDOW_WIDTH;
 int _viewport_y = DEFAULT_WINDOW_HEIGHT;
 
 vec2 crop_points[4]; // IPC
+vec2 start_crop_points[4]; // from --crop
+int crop_given=0;
 int selected_crop_point = -1;
 vec2 crop_aspect;
+double crop_h[3][3]; // the crop as a perspective transform (see update_crop)
 float wpc2ipc_scale = 1.0f;
 
-GLuint tex;
+typedef struct tiled_texture tiled_texture;
+tiled_texture *tex; // the pre-processed image (see tiled textures)
+moment_tables *stats = NULL; // kept after loading, so the radius can be changed without starting over
 int image_width, image_height;
 unsigned char *image_data;
 const char* input_filename=NULL;
@@ -61,427 +77,2945 @@ char output_filename[OUTPUT_FILENAME_MAX_CHARS];
 int save_and_quit=0;
 int finished_everything=0;
 
+int num_threads=0; // 0 = one per CPU core
+int stats_scale=0; // work out the local statistics on the image shrunk this many times (faster, uses less memory); 0 = 1 on the CPU, 8 on the GPU
+int use_gpu=0;     // pre-process with shaders on the graphics card
+int check_gpu=0;   // ... and compare with the CPU's result
+int half_floats=0;  // keep the texture, and the full-size grey image for --stats-scale, in half precision
+int stream_input=0; // pre-process in one pass down the image, without the tables (see stream_normalise)
+int anisotropy=1;   // where the crop is steep, up to this many samples along each pixel's long side, on screen and saving (1 = off)
+int local_range=256; // this is the approximate radius (in pixels) for the brightness/contrast auto-adjustments in pre-processing
+int quiet=0;         // no progress dots (--batch: the images' messages would get mixed up)
+
 
 void update_output_filename() {
  time_t t; time(&t);
  strftime(output_filename, OUTPUT_FILENAME_MAX_CHARS, "paper-%F-%T.png", localtime(&t));
 }
 
+double now_ms() { // for timing things (GLUT_ELAPSED_TIME is only to the ms, and needs a window)
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+
+// h := the perspective transform taking (u,v) = (0,0), (1,0), (1,1), (0,1) to the points q[0..3] (in IPC),
+// as a 3x3 matrix for homogeneous coordinates: (x*w, y*w, w) = h * (u, v, 1).
+void quad_homography(const vec2 q[4], double h[3][3]) {
+ double sx = q[0].x - q[1].x + q[2].x - q[3].x, dx1 = q[1].x - q[2].x, dx2 = q[3].x - q[2].x;
+ double sy = q[0].y - q[1].y + q[2].y - q[3].y, dy1 = q[1].y - q[2].y, dy2 = q[3].y - q[2].y;
+ double den = dx1*dy2 - dx2*dy1;
+ double g = 0.0, k = 0.0; // zero for a parallelogram
+ if (den != 0.0) {
+  g = (sx*dy2 - dx2*sy) / den;
+  k = (dx1*sy - sx*dy1) / den;
+ }
+ h[0][0] = q[1].x - q[0].x + g*q[1].x;  h[0][1] = q[3].x - q[0].x + k*q[3].x;  h[0][2] = q[0].x;
+ h[1][0] = q[1].y - q[0].y + g*q[1].y;  h[1][1] = q[3].y - q[0].y + k*q[3].y;  h[1][2] = q[0].y;
+ h[2][0] = g;                           h[2][1] = k;                           h[2][2] = 1.0;
+}
+
+// The crop area is a quadrilateral shape defined by the 4 crop points. We interperet it as a rectangle in perspective:
+// h takes the rectangle's corners, (0,0) top left to (1,1) bottom right, to the points (corner 1 first, see key_down),
+// and aspect is its size, the average of each pair of opposite sides.
+void crop_transform(const vec2 points[4], double h[3][3], vec2 *aspect) {
+ vec2 corners[4] = { points[3], points[2], points[1], points[0] };
+ quad_homography(corners, h);
+ aspect->x = sqrtf(0.5f*( (points[0].x - points[1].x) * (points[0].x - points[1].x)
+                        + (points[0].y - points[1].y) * (points[0].y - points[1].y)
+                        + (points[2].x - points[3].x) * (points[2].x - points[3].x)
+                        + (points[2].y - points[3].y) * (points[2].y - points[3].y)));
+ aspect->y = sqrtf(0.5f*( (points[0].x - points[3].x) * (points[0].x - points[3].x)
+                        + (points[0].y - points[3].y) * (points[0].y - points[3].y)
+                        + (points[2].x - points[1].x) * (points[2].x - points[1].x)
+                        + (points[2].y - points[1].y) * (points[2].y - points[1].y)));
+}
+
+// Call whenever crop_points change.
+void update_crop() {
+ crop_transform(crop_points, crop_h, &crop_aspect);
+}
+
+void crop_size(int *width, int *height) { // of the output, in pixels
+ *width  = crop_aspect.x+0.5f > 1 ? crop_aspect.x+0.5f : 1;
+ *height = crop_aspect.y+0.5f > 1 ? crop_aspect.y+0.5f : 1;
+}
+
+void reset_crop_points() {
+ crop_points[0].x = 0.0f;         crop_points[0].y = image_height;
+ crop_points[1].x = image_width;  crop_points[1].y = image_height;
+ crop_points[2].x = image_width;  crop_points[2].y = 0.0f;
+ crop_points[3].x = 0.0f;         crop_points[3].y = 0.0f;
+}
+
+
+/* Conversion functions for different coordinate systems:
+    WPC - window pixel coords
+    IPC - image pixel coords
+    TXC - texture coords (OpenGL)
+    NDC - normalized device coords (OpenGL)
+*/
+vec2 wpc2ipc(vec2 coord) {
+ coord.x -= _viewport_x/4;
+ coord.y -= _viewport_y/2;
+ coord.x *= wpc2ipc_scale;
+ coord.y *= wpc2ipc_scale;
+ coord.x += image_width/2;
+ coord.y += image_height/2;
+ return coord;
+}
+vec2 ipc2wpc(vec2 coord) {
+ coord.x -= image_width/2;
+ coord.y -= image_height/2;
+ coord.x /= wpc2ipc_scale;
+ coord.y /= wpc2ipc_scale;
+ coord.x += _viewport_x/4;
+ coord.y += _viewport_y/2;
+ return coord; 
+}
+vec2 wpc2ndc(vec2 coord) {
+ coord.x = coord.x *  2.0f/_viewport_x - 1.0f;
+ coord.y = coord.y * -2.0f/_viewport_y + 1.0f;
+ return coord;
+}
+vec2 ipc2txc(vec2 coord) {
+ coord.x /= image_width;
+ coord.y /= image_height;
+ return coord;
+}
+
+
+
+
+
+
+void textGL(const char *str, float line) {
+ glRasterPos2f(-9.f *  strlen(str)   / _viewport_x,
+              -15.f * (line*2.f+1.f) / _viewport_y);
+ while (*str) glutBitmapCharacter(GLUT_BITMAP_9_BY_15, *(str++));
+}
+
+void flush() {
+ glutSwapBuffers();
+ glClear(GL_COLOR_BUFFER_BIT);
+ glColor3f(1.0f, 1.0f, 1.0f);
+}
+
+
+
+
+/* SIMD kernels, for the inner loops of the pre-processing.
+   Each kernel is written once, in plain C, and then compiled again for SSE2, AVX2 and AVX-512 using GCC's target attribute
+   (the compiler vectorises the loops with the wider registers). select_kernels() picks the best set the CPU has.
+   The "generic" set is whatever the compiler does by default, and is the only one on other compilers and CPUs.
+*/
+#if defined(__GNUC__)
+#define KERNEL static inline __attribute__((always_inline))
+#else
+#define KERNEL static inline
+#endif
+
+KERNEL void k_greyscale(float *restrict out, const unsigned char *restrict px, int channels, int begin, int end) { // out := pixels converted to greyscale, 0.0 = middle grey
+ if (channels == 3) {
+  for (int i=begin; i<end; i++) out[i] = 0.299f*(px[i*3]   - 127.5f)
+                                       + 0.587f*(px[i*3+1] - 127.5f)
+                                       + 0.114f*(px[i*3+2] - 127.5f);
+ }
+ else {
+  for (int i=begin; i<end; i++) out[i] = px[i*channels] - 127.5f;
+ }
+}
+
+/* The local average and standard deviation come from "summed-area tables" of grey and grey^2:
+   table[y][x] holds the totals over the rectangle [0,x) x [0,y) of the image, so the totals over any rectangle
+   take 4 lookups, whatever its size. The table is (width+1) x (height+1), with a row and a column of zeros.
+   Totals are worked out in double precision: over 48 million pixels they get large, and the variance comes out of
+   a small difference between two of them. But 16 bytes a pixel is too much to keep, so only every TABLE_BAND'th row
+   is kept like that; the rows in between are kept as float totals down each column since the last of those (8 bytes
+   a pixel), and are added up across again (k_table_row) when they're needed. For a grey image they're exact: grey is
+   a whole number minus 127.5, so grey^2 is in quarters, and 64 of them fit in float's 24 bits. Grey made from colour
+   has fractions in it, and then they're rounded, by far less than a grey level.
+*/
+#define TABLE_BAND 64
+typedef struct { double s, ss; } moment;       // totals of grey and of grey^2
+typedef struct { float s, ss; } column_moment; // the same, down a column from the last full row (see moment_tables)
+
+// out := a row of the table: full is the full row at or above it, columns its totals down each column from there.
+// (Also, with full a row of zeros, the totals of a band of rows, added up across.)
+KERNEL void k_table_row(moment *restrict out, const moment *restrict full, const column_moment *restrict columns, int width) {
+ double s=0, ss=0;
+ out[0] = full[0];
+ for (int x=0; x<width; x++) {
+  s  += columns[x].s;
+  ss += columns[x].ss;
+  out[x+1].s  = full[x+1].s  + s;
+  out[x+1].ss = full[x+1].ss + ss;
+ }
+}
+
+// Adds up the table down the columns x0..x1-1, turning per-band totals into rectangle totals (for the full rows).
+// Goes row by row, so memory is read in order; the columns are independent, so this vectorises.
+KERNEL void k_column_moments(moment *restrict table, int stride, int height, int x0, int x1) {
+ for (int y=1; y<=height; y++) {
+  const moment *restrict above = &table[(size_t)(y-1)*stride];
+  moment       *restrict row   = &table[(size_t) y   *stride];
+  for (int x=x0; x<x1; x++) {
+   row[x].s  += above[x].s;
+   row[x].ss += above[x].ss;
+  }
+ }
+}
+
+// One row of the final "contrast-normalized" image:  out := (grey - local average) / local std dev * 0.5 + 1
+// top/bottom are the table rows above and below the box around this row, grey is the row itself.
+// The box is [x-range+1, x+range] across, cut off at the image edges; the missing pixels count as 0 (middle grey),
+// so it's always divided by the full box area.
+KERNEL void k_normalise_row(const moment *restrict top, const moment *restrict bottom, const float *restrict grey,
+                            float *restrict out, int width, int range, double inv_area)
+{
+ #define NORMALISE(x, x0, x1) { \
+  double s  = bottom[x1].s  - bottom[x0].s  - top[x1].s  + top[x0].s;  \
+  double ss = bottom[x1].ss - bottom[x0].ss - top[x1].ss + top[x0].ss; \
+  double g  = grey[x];                                                \
+  double m  = s * inv_area;                                           \
+  float  v  = ss * inv_area - m*m;  /* the cancellation is over, float is enough now */ \
+  if (v < 1e-6f) v = 1e-6f;                                           \
+  out[x] = (float)(g - m) * (0.5f / sqrtf(v)) + 1.0f;                }
+ int x = 0;
+ int left  = range-1 < width ? range-1 : width;     // pixels whose box sticks out on the left
+ int right = width-range > left ? width-range : left; // ... and on the right
+ for (   ; x<left;  x++) NORMALISE(x, 0,         x+range+1 < width ? x+range+1 : width)
+ for (   ; x<right; x++) NORMALISE(x, x-range+1, x+range+1)
+ for (   ; x<width; x++) NORMALISE(x, x-range+1 > 0 ? x-range+1 : 0, width)
+ #undef NORMALISE
+}
+
+// Same as k_normalise_row, for when the statistics were worked out on a shrunk image (see build_moments):
+// the local average and 0.5/std dev are interpolated between the shrunk image's pixels, index[x] and index[x]+1.
+KERNEL void k_upsample_row(const float *restrict grey, const float *restrict mean, const float *restrict inv_std,
+                           const int *restrict index, const float *restrict weight, float *restrict out, int width)
+{
+ for (int x=0; x<width; x++) {
+  int   i = index[x];
+  float f = weight[x];
+  float m = mean[i]    + (mean[i+1]    - mean[i])    * f;
+  float k = inv_std[i] + (inv_std[i+1] - inv_std[i]) * f;
+  out[x] = (grey[x] - m) * k + 1.0f;
+ }
+}
+
+/* For the CPU perspective warp (see warp_image): a pyramid of mipmap levels, like the ones glGenerateMipmap makes.
+   Level l is halved l times (rounded down, to no less than 1): max(1, width >> l) x max(1, height >> l) floats at pixels+offset[l].
+*/
+#define MAX_MIP_LEVELS 32
+typedef struct {
+ int width, height; // of level 0
+ int levels;
+ size_t offset[MAX_MIP_LEVELS];
+ float *pixels;
+} mip_pyramid;
+
+// Bilinear sample of level l at (x,y), in pixels of level 0, clamped to the edges: what GL_LINEAR does with GL_CLAMP_TO_EDGE.
+// (The level's size is worked out rather than looked up, which vectorizes better.) wide: the pyramid has 2^31 texels or more,
+// so the index needs 64 bits, which the compiler can't gather with.
+KERNEL float k_bilinear(const float *restrict pixels, const size_t *restrict offset, int width, int height, int l, float x, float y, int wide) {
+ int w = width >> l, h = height >> l;
+ w = w > 1 ? w : 1;
+ h = h > 1 ? h : 1;
+ float tx = x * ((float)w / width) - 0.5f,  ty = y * ((float)h / height) - 0.5f;
+ tx = fminf(fmaxf(tx, 0.0f), w-1);
+ ty = fminf(fmaxf(ty, 0.0f), h-1);
+ int ix = (int)tx, iy = (int)ty;
+ int dx = ix < w-1, dy = iy < h-1 ? w : 0; // (the step to the next texel; none on the last one)
+ float fx = tx - ix, fy = ty - iy;
+ float a, b, c, d;
+ if (wide) { size_t k = offset[l] + (size_t)iy * w + ix;  a = pixels[k];  b = pixels[k+dx];  c = pixels[k+dy];  d = pixels[k+dy+dx]; }
+ else      { int    k = (int)offset[l] + iy * w + ix;     a = pixels[k];  b = pixels[k+dx];  c = pixels[k+dy];  d = pixels[k+dy+dx]; }
+ float top    = a + (b - a) * fx;
+ float bottom = c + (d - c) * fx;
+ return top + (bottom - top) * fy;
+}
+
+// Trilinear sample at (x,y): levels l and l+1, where l = (int)lod.
+KERNEL float k_trilinear(const float *restrict pixels, const size_t *restrict offset, int width, int height, int top, float lod,
+                         float x, float y, int wide)
+{
+ int l = (int)lod, next = l < top ? l+1 : l;
+ float near = k_bilinear(pixels, offset, width, height, l, x, y, wide);
+ return near + (k_bilinear(pixels, offset, width, height, next, x, y, wide) - near) * (lod - l);
+}
+
+// (see k_warp_row)
+KERNEL void k_warp_pixels(const mip_pyramid *restrict p, const float *restrict start, const float *restrict step, const float *restrict down,
+                          int trilinear, int anisotropy, unsigned char *restrict out, int width, int wide)
+{
+ const float *pixels = p->pixels;
+ const size_t *offset = p->offset;
+ int w0 = p->width, h0 = p->height, top = p->levels-1;
+ float no_lod = trilinear ? 1e30f : 1.0f, most_samples = anisotropy;
+ for (int i0=0; i0<width; i0+=64) {
+  int count = width-i0 < 64 ? width-i0 : 64;
+  float v[64], xs[64], ys[64], axis_x[64], axis_y[64], lods[64], samples[64], inside[64];
+  float most = 1;
+  for (int j=0; j<count; j++) {
+   float i = i0+j;
+   float X = start[0] + i*step[0], Y = start[1] + i*step[1], W = start[2] + i*step[2];
+   float inv_w = 1.0f / W, x = X * inv_w, y = Y * inv_w;
+   inside[j] = (x >= 0) & (x <= w0) & (y >= 0) & (y <= h0) ? 1.0f : 0.0f;
+   x = fminf(fmaxf(x, 0.0f), w0);
+   y = fminf(fmaxf(y, 0.0f), h0);
+   // the footprint: how far across and down one output pixel reaches on the image
+   float ax = (step[0] - x*step[2]) * inv_w, ay = (step[1] - y*step[2]) * inv_w;
+   float bx = (down[0] - x*down[2]) * inv_w, by = (down[1] - y*down[2]) * inv_w;
+   float a2 = ax*ax + ay*ay, b2 = bx*bx + by*by;
+   float major2 = fmaxf(a2, b2), minor2 = fminf(a2, b2);
+   // anisotropic: n samples along the long side, each with a level of detail for its share of it
+   // (as many as it's longer than it is wide, but no more than the texels it covers, or than allowed)
+   float n = fminf(ceilf(sqrtf(major2 / fmaxf(minor2, 1e-12f))), ceilf(sqrtf(major2)));
+   n = fminf(fmaxf(n, 1.0f), most_samples);
+   samples[j] = n;
+   most = fmaxf(most, n);
+   axis_x[j] = a2 > b2 ? ax : bx;
+   axis_y[j] = a2 > b2 ? ay : by;
+   xs[j] = x;
+   ys[j] = y;
+   // the level of detail: log2 of rho^2 over 2, with a quick log2 (good to about 0.01)
+   float rho2 = fminf(fmaxf(major2 / (n*n), 1.0f), no_lod); // (magnified: just the full-size image)
+   uint32_t bits;  memcpy(&bits, &rho2, 4);
+   float m;  uint32_t mbits = (bits & 0x7fffff) | 0x3f800000;  memcpy(&m, &mbits, 4);
+   float lod = 0.5f * ((float)((int)(bits >> 23) - 127) + (m-1.0f) * (1.3465f - 0.3465f*(m-1.0f)));
+   lods[j] = fminf(lod, top);
+  }
+  if (most == 1) { // (about square, as for most crops: one sample each)
+   for (int j=0; j<count; j++) v[j] = k_trilinear(pixels, offset, w0, h0, top, lods[j], xs[j], ys[j], wide) * inside[j];
+  }
+  else {
+   for (int j=0; j<count; j++) v[j] = 0;
+   for (float s=0; s<most; s++) {
+    for (int j=0; j<count; j++) {
+     float t = (s+0.5f) / samples[j] - 0.5f; // (spread evenly along the axis, centred on the pixel)
+     float x = fminf(fmaxf(xs[j] + t*axis_x[j], 0.0f), w0);
+     float y = fminf(fmaxf(ys[j] + t*axis_y[j], 0.0f), h0);
+     float sample = k_trilinear(pixels, offset, w0, h0, top, lods[j], x, y, wide);
+     v[j] += fminf(fmaxf(samples[j] - s, 0.0f), 1.0f) * sample; // (1 if s < samples[j], else 0)
+    }
+   }
+   for (int j=0; j<count; j++) v[j] *= inside[j] / samples[j];
+  }
+  for (int j=0; j<count; j++) out[i0+j] = (unsigned char)(fminf(fmaxf(v[j], 0.0f), 1.0f) * 255.0f + 0.5f);
+ }
+}
+
+// One row of the warped image. Each pixel is at (X/W, Y/W) on the image, where (X,Y,W) = start + i*step;
+// down is how (X,Y,W) changes from one row to the next, which with step gives the level of detail, the way GL works it out
+// (log2 of how many image pixels one output pixel covers). Pixels outside the image are black.
+// With anisotropy > 1, a pixel whose footprint is long and thin (the far side of a steep crop) is that many samples along it,
+// from a sharper level, like GL_TEXTURE_MAX_ANISOTROPY; a row where every footprint is about square takes one sample per pixel.
+// There are no branches, so that it vectorizes (with gathers for the texels): every pixel samples two levels.
+// It goes 64 pixels at a time through float arrays on the stack, since a byte store could alias the image as far as the compiler knows.
+KERNEL void k_warp_row(const mip_pyramid *restrict p, const float *restrict start, const float *restrict step, const float *restrict down,
+                       int trilinear, int anisotropy, unsigned char *restrict out, int width)
+{
+ if (p->offset[p->levels-1] < 0x7fffffff) k_warp_pixels(p, start, step, down, trilinear, anisotropy, out, width, 0); // (two copies of the loop,
+ else                                     k_warp_pixels(p, start, step, down, trilinear, anisotropy, out, width, 1); //  one that vectorizes)
+}
+
+typedef struct {
+ const char *name;
+ void (*greyscale)(float*, const unsigned char*, int, int, int);
+ void (*table_row)(moment*, const moment*, const column_moment*, int);
+ void (*column_moments)(moment*, int, int, int, int);
+ void (*normalise_row)(const moment*, const moment*, const float*, float*, int, int, double);
+ void (*upsample_row)(const float*, const float*, const float*, const int*, const float*, float*, int);
+ void (*warp_row)(const mip_pyramid*, const float*, const float*, const float*, int, int, unsigned char*, int);
+} kernel_set;
+
+// Instantiates every kernel for one instruction set, plus a kernel_set pointing at them.
+#define KERNEL_SET(isa, attributes) \
+ attributes void greyscale_##isa(float *o, const unsigned char *px, int c, int b, int e) { k_greyscale(o, px, c, b, e); } \
+ attributes void table_row_##isa(moment *o, const moment *f, const column_moment *c, int w) { k_table_row(o, f, c, w); } \
+ attributes void column_moments_##isa(moment *t, int stride, int h, int x0, int x1) { k_column_moments(t, stride, h, x0, x1); } \
+ attributes void normalise_row_##isa(const moment *t, const moment *b, const float *g, float *o, int w, int r, double a) \
+  { k_normalise_row(t, b, g, o, w, r, a); } \
+ attributes void upsample_row_##isa(const float *g, const float *m, const float *k, const int *i, const float *f, float *o, int w) \
+  { k_upsample_row(g, m, k, i, f, o, w); } \
+ attributes void warp_row_##isa(const mip_pyramid *p, const float *s, const float *d, const float *n, int t, int a, unsigned char *o, int w) \
+  { k_warp_row(p, s, d, n, t, a, o, w); } \
+ kernel_set kernels_##isa = { #isa, greyscale_##isa, table_row_##isa, column_moments_##isa, normalise_row_##isa, upsample_row_##isa, \
+                              warp_row_##isa };
+
+KERNEL_SET(generic, )
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+KERNEL_SET(sse2,   __attribute__((target("sse2"))))
+KERNEL_SET(avx2,   __attribute__((target("avx2"))))
+KERNEL_SET(avx512, __attribute__((target("avx512f"))))
+#endif
+
+kernel_set *kernels = &kernels_generic;
+
+// Half precision floats (for --half), kept as their bits. The plain C versions round to nearest even, like F16C.
+typedef uint16_t half;
+void to_half_generic(half *restrict out, const float *restrict in, int n) {
+ for (int i=0; i<n; i++) {
+  uint32_t x;  memcpy(&x, &in[i], 4);
+  uint32_t sign = (x >> 16) & 0x8000, mant = x & 0x7fffff;
+  int exp = (int)((x >> 23) & 0xff) - 127 + 15;
+  uint32_t h, rest, halfway;
+  if (((x >> 23) & 0xff) == 0xff) { out[i] = sign | 0x7c00 | (mant ? 0x200 : 0);  continue; } // inf, nan
+  if (exp >= 31)                  { out[i] = sign | 0x7c00;  continue; }                      // too big
+  if (exp <= 0) {                                                                             // tiny
+   if (exp < -10) { out[i] = sign;  continue; }
+   mant |= 0x800000;
+   h = mant >> (14-exp);  rest = mant & ((1u << (14-exp)) - 1);  halfway = 1u << (13-exp);
+  }
+  else { h = (exp << 10) | (mant >> 13);  rest = mant & 0x1fff;  halfway = 0x1000; }
+  if (rest > halfway || (rest == halfway && (h & 1))) h++; // (carrying into the exponent is still right)
+  out[i] = sign | h;
+ }
+}
+void from_half_generic(float *restrict out, const half *restrict in, int n) {
+ for (int i=0; i<n; i++) {
+  uint32_t sign = (uint32_t)(in[i] & 0x8000) << 16, exp = (in[i] >> 10) & 0x1f, mant = in[i] & 0x3ff, x;
+  if (exp == 0x1f) x = sign | 0x7f800000 | (mant << 13) | (mant ? 0x400000 : 0); // (nans come out quiet)
+  else if (exp)    x = sign | ((exp + 112) << 23) | (mant << 13);
+  else if (!mant)  x = sign;
+  else { // subnormal
+   exp = 113;
+   while (!(mant & 0x400)) { mant <<= 1;  exp--; }
+   x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  }
+  memcpy(&out[i], &x, 4);
+ }
+}
+#ifdef HAVE_X86_KERNELS
+#include <immintrin.h>
+__attribute__((target("avx,f16c"))) void to_half_f16c(half *restrict out, const float *restrict in, int n) {
+ int i = 0;
+ for ( ; i+8<=n; i+=8) _mm_storeu_si128((__m128i*)&out[i], _mm256_cvtps_ph(_mm256_loadu_ps(&in[i]), _MM_FROUND_TO_NEAREST_INT));
+ to_half_generic(&out[i], &in[i], n-i);
+}
+__attribute__((target("avx,f16c"))) void from_half_f16c(float *restrict out, const half *restrict in, int n) {
+ int i = 0;
+ for ( ; i+8<=n; i+=8) _mm256_storeu_ps(&out[i], _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)&in[i])));
+ from_half_generic(&out[i], &in[i], n-i);
+}
+#endif
+void (*to_half)(half*, const float*, int)   = to_half_generic;
+void (*from_half)(float*, const half*, int) = from_half_generic;
+
+// Picks the kernels by name, or the best ones the CPU supports if name is NULL. Returns 0 if the name isn't usable here.
+int select_kernels(const char *name) {
+ kernel_set *all[4] = { &kernels_generic };
+ int n=1;
+ #ifdef HAVE_X86_KERNELS
+ __builtin_cpu_init();
+ if (__builtin_cpu_supports("sse2"))    all[n++] = &kernels_sse2;
+ if (__builtin_cpu_supports("avx2"))    all[n++] = &kernels_avx2;
+ if (__builtin_cpu_supports("avx512f")) all[n++] = &kernels_avx512;
+ #endif
+ if (name) {
+  int i = 0;
+  while (i<n && strcmp(name, all[i]->name)) i++;
+  if (i == n) return 0;
+  n = i+1;
+ }
+ kernels = all[n-1];
+ #ifdef HAVE_X86_KERNELS
+ if (kernels != &kernels_generic && __builtin_cpu_supports("f16c")) { to_half = to_half_f16c;  from_half = from_half_f16c; }
+ #endif
+ return 1;
+}
+
+
+
+
+/* Worker pool, for the pre-processing.
+   parallel_for() cuts [0,count) into one band per thread, runs func on every band, and returns when they're all finished.
+   The calling thread does band 0 itself. Only one thread may call parallel_for() at a time.
+   pool_band says which band the current thread is doing, so band functions can keep scratch space per thread.
+*/
+typedef void (*band_func)(void *ctx, int begin, int end);
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  pool_wake  = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  pool_done  = PTHREAD_COND_INITIALIZER;
+band_func pool_func;
+void     *pool_ctx;
+int       pool_count;
+int       pool_generation=0;
+int       pool_pending=0;
+__thread int pool_band=0; // (0 in the calling thread, and in threads that aren't in the pool)
+
+int band_start(int count, int band) { return (int64_t)count * band / num_threads; }
+
+void *pool_worker(void *arg) {
+ int band = (int)(intptr_t)arg;
+ int generation = 0;
+ pool_band = band;
+ pthread_mutex_lock(&pool_mutex);
+ for (;;) {
+  while (pool_generation == generation) pthread_cond_wait(&pool_wake, &pool_mutex);
+  generation = pool_generation;
+  band_func func = pool_func;
+  void     *ctx  = pool_ctx;
+  int      count = pool_count;
+  pthread_mutex_unlock(&pool_mutex);
+  func(ctx, band_start(count, band), band_start(count, band+1));
+  pthread_mutex_lock(&pool_mutex);
+  if (--pool_pending == 0) pthread_cond_signal(&pool_done);
+ }
+ return NULL;
+}
+
+int cpu_cores() {
+ int n = 1;
+ #ifdef _SC_NPROCESSORS_ONLN
+ n = sysconf(_SC_NPROCESSORS_ONLN);
+ #endif
+ return n > 1 ? n : 1;
+}
+
+void start_workers() {
+ if (num_threads < 1) num_threads = cpu_cores();
+ for (int i=1; i<num_threads; i++) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, pool_worker, (void*)(intptr_t)i)) { num_threads = i; break; }
+  pthread_detach(thread);
+ }
+}
+
+void parallel_for(int count, band_func func, void *ctx) {
+ if (num_threads <= 1) { func(ctx, 0, count); return; }
+ pthread_mutex_lock(&pool_mutex);
+ pool_func    = func;
+ pool_ctx     = ctx;
+ pool_count   = count;
+ pool_pending = num_threads-1;
+ pool_generation++;
+ pthread_cond_broadcast(&pool_wake);
+ pthread_mutex_unlock(&pool_mutex);
+ func(ctx, 0, band_start(count, 1));
+ pthread_mutex_lock(&pool_mutex);
+ while (pool_pending) pthread_cond_wait(&pool_done, &pool_mutex);
+ pthread_mutex_unlock(&pool_mutex);
+}
+
+
+
+
+// malloc() for image-sized buffers. On Linux it asks for huge pages, which makes touching a fresh buffer for the first time
+// several times cheaper (one page fault per 2MB instead of per 4KB). Free it with free().
+void *big_malloc(size_t size) {
+ #ifdef MADV_HUGEPAGE
+ void *p;
+ if (size >= (2<<20) && !posix_memalign(&p, 2<<20, size)) {
+  madvise(p, size, MADV_HUGEPAGE);
+  return p;
+ }
+ #endif
+ return malloc(size);
+}
+
+
+
+
+/* The pre-processing.
+   It turns the decoded pixels into a "contrast-normalized" greyscale image, where every area has roughly the same
+   average brightness and contrast: each pixel's distance from the average of the pixels within 'range' of it,
+   divided by their standard deviation. The moment tables are built once, after which any range costs the same.
+*/
+struct moment_tables {
+ int width;
+ int height;
+ int scale;        // 1, or the statistics are for the image shrunk this many times (averages of scale x scale blocks)
+ int level_width;  // size of the (maybe shrunk) image the table is for
+ int level_height; //
+ int stride;       // = level_width+1
+ moment *full_rows;        // rows 0, TABLE_BAND, 2*TABLE_BAND... of the table, stride apart (see k_table_row)
+ column_moment *columns;   // level_width x (level_height+1): for each row y of the table, the totals down each column
+                           // of the rows from the full row above it, (y-1)/TABLE_BAND, to row y (so row 0 is zeros)
+ const unsigned char *pixels;
+ int channels;
+ float *out;       // where normalise() puts row first_row
+ int first_row;
+ int range_x;
+ int range_y;
+ // only when scale > 1:
+ float *grey;      // the full-size greyscale image (the table can't give it back)
+ half *grey_half;  // ... or that in half precision, for --half
+ int *col_index;   // for each column of the image, the shrunk image's column just left of it...
+ float *col_weight;// ... and how far it is towards the next one
+ float *mean;      // local average and 0.5/std dev for each pixel of the shrunk image, with a copy of the last column on the end
+ float *inv_std;   //
+ int map_range;    // the range they're for (0 = none yet)
+ float *scratch;   // room for scratch_size floats per thread (see thread_scratch), so the steps don't need to allocate
+ size_t scratch_size;
+};
+
+float *thread_scratch(moment_tables *m) { return &m->scratch[pool_band * m->scratch_size]; }
+
+// out := row y of the table, as far as column 'width' (the whole row is level_width)
+void get_table_row(moment_tables *m, int y, moment *out, int width) {
+ kernels->table_row(out, &m->full_rows[(size_t)(y > 0 ? (y-1) / TABLE_BAND : 0) * m->stride],
+                    &m->columns[(size_t)y * m->level_width], width);
+}
+// grey := row y of the image (when scale is 1: it's the difference between two rows of column totals)
+void get_grey_row(moment_tables *m, int y, float *grey) {
+ const column_moment *above = &m->columns[(size_t)y * m->level_width], *below = above + m->level_width;
+ if (y % TABLE_BAND) for (int x=0; x<m->width; x++) grey[x] = below[x].s - above[x].s;
+ else                for (int x=0; x<m->width; x++) grey[x] = below[x].s; // (the rows above it are in a full row)
+}
+// columns row y+1 := row y's (or zeros, if y is a full row) plus row y of the (maybe shrunk) image, and at the end of a
+// band of TABLE_BAND rows, the full row there := the band's totals, added up across (step_column_moments does the rest).
+// grey_sq is the values to total for grey^2, or NULL to square grey (for the shrunk image, they're block averages).
+void add_column_moments(moment_tables *m, int y, const float *grey, const float *grey_sq) {
+ int w = m->level_width, first = y % TABLE_BAND == 0;
+ column_moment *row = &m->columns[(size_t)(y+1) * w];
+ const column_moment *above = row - w;
+ for (int x=0; x<w; x++) {
+  float sq = grey_sq ? grey_sq[x] : grey[x]*grey[x];
+  row[x].s  = (first ? 0 : above[x].s)  + grey[x];
+  row[x].ss = (first ? 0 : above[x].ss) + sq;
+ }
+ if ((y+1) % TABLE_BAND == 0) kernels->table_row(&m->full_rows[(size_t)(y+1) / TABLE_BAND * m->stride], m->full_rows, row, w);
+}
+
+void step_band_moments(void *ctx, int begin, int end) { // (bands of TABLE_BAND rows) columns := totals down each column
+ moment_tables *m = ctx;
+ float *grey = thread_scratch(m);
+ int y1 = end*TABLE_BAND < m->height ? end*TABLE_BAND : m->height;
+ for (int y=begin*TABLE_BAND; y<y1; y++) {
+  kernels->greyscale(grey, &m->pixels[(size_t)y * m->width * m->channels], m->channels, 0, m->width);
+  add_column_moments(m, y, grey, NULL);
+ }
+}
+void step_shrunk_band_moments(void *ctx, int begin, int end) { // same, for the shrunk image; also fills in m->grey
+ moment_tables *m = ctx;
+ int n = m->scale;
+ float *temp = thread_scratch(m);
+ float *s    = temp + m->width;
+ float *ss   = s + m->level_width;
+ int last = end*TABLE_BAND < m->level_height ? end*TABLE_BAND : m->level_height;
+ for (int ly=begin*TABLE_BAND; ly<last; ly++) {
+  int y0 = ly*n, y1 = y0+n < m->height ? y0+n : m->height;
+  memset(s,  0, m->level_width * sizeof(float));
+  memset(ss, 0, m->level_width * sizeof(float));
+  for (int y=y0; y<y1; y++) {
+   float *grey = m->grey_half ? temp : &m->grey[(size_t)y * m->width];
+   kernels->greyscale(grey, &m->pixels[(size_t)y * m->width * m->channels], m->channels, 0, m->width);
+   for (int lx=0, x=0; lx<m->level_width; lx++) {
+    int x1 = x+n < m->width ? x+n : m->width;
+    for ( ; x<x1; x++) { s[lx] += grey[x];  ss[lx] += grey[x]*grey[x]; }
+   }
+   if (m->grey_half) to_half(&m->grey_half[(size_t)y * m->width], grey, m->width);
+  }
+  for (int lx=0; lx<m->level_width; lx++) { // block totals -> block averages (the blocks on the edges can be smaller)
+   int w = m->width - lx*n < n ? m->width - lx*n : n;
+   float inv_count = 1.0f / (w * (y1-y0));
+   s[lx] *= inv_count;  ss[lx] *= inv_count;
+  }
+  add_column_moments(m, ly, s, ss);
+ }
+}
+void step_column_moments(void *ctx, int begin, int end) { // (tiles of 64 columns) full rows := rectangle totals
+ moment_tables *m = ctx;
+ int x1 = end*64 < m->stride ? end*64 : m->stride;
+ kernels->column_moments(m->full_rows, m->stride, m->level_height / TABLE_BAND, begin*64, x1);
+}
+void step_normalise(void *ctx, int begin, int end) { // out rows := contrast-normalized image
+ moment_tables *m = ctx;
+ double inv_area = 0.25 / ((double)m->range_x * m->range_y);
+ moment *top = (moment*)thread_scratch(m), *bottom = top + m->stride;
+ float *grey = (float*)(bottom + m->stride);
+ int top_y = -1, bottom_y = -1; // (the rows in top and bottom, which stay put at the edges)
+ for (int y=m->first_row+begin; y<m->first_row+end; y++) {
+  int y0 = y-m->range_y+1 > 0         ? y-m->range_y+1 : 0;
+  int y1 = y+m->range_y+1 < m->height ? y+m->range_y+1 : m->height;
+  if (y0 != top_y)    get_table_row(m, top_y = y0,    top,    m->width);
+  if (y1 != bottom_y) get_table_row(m, bottom_y = y1, bottom, m->width);
+  get_grey_row(m, y, grey);
+  kernels->normalise_row(top, bottom, grey, &m->out[(size_t)(y - m->first_row) * m->width], m->width, m->range_x, inv_area);
+ }
+}
+void step_shrunk_stats(void *ctx, int begin, int end) { // mean, inv_std rows := statistics of the shrunk image
+ moment_tables *m = ctx;
+ int w = m->level_width, rx = m->range_x, ry = m->range_y;
+ double inv_area = 0.25 / ((double)rx * ry);
+ moment *top = (moment*)thread_scratch(m), *bottom = top + m->stride;
+ for (int y=begin; y<end; y++) {
+  get_table_row(m, y-ry+1 > 0              ? y-ry+1 : 0,              top,    w);
+  get_table_row(m, y+ry+1 < m->level_height ? y+ry+1 : m->level_height, bottom, w);
+  float *mean = &m->mean[(size_t)y * (w+1)], *inv_std = &m->inv_std[(size_t)y * (w+1)];
+  for (int x=0; x<w; x++) {
+   int x0 = x-rx+1 > 0 ? x-rx+1 : 0, x1 = x+rx+1 < w ? x+rx+1 : w;
+   double s  = bottom[x1].s  - bottom[x0].s  - top[x1].s  + top[x0].s;
+   double ss = bottom[x1].ss - bottom[x0].ss - top[x1].ss + top[x0].ss;
+   double mu = s * inv_area;
+   float  v  = ss * inv_area - mu*mu;
+   if (v < 1e-6f) v = 1e-6f;
+   mean[x] = mu;
+   inv_std[x] = 0.5f / sqrtf(v);
+  }
+  mean[w] = mean[w-1];
+  inv_std[w] = inv_std[w-1];
+ }
+}
+void step_upsample(void *ctx, int begin, int end) { // out rows := contrast-normalized image, from the shrunk statistics
+ moment_tables *m = ctx;
+ int w = m->level_width+1;
+ float *temp    = thread_scratch(m);
+ float *mean    = temp + m->width;
+ float *inv_std = mean + w;
+ for (int y=m->first_row+begin; y<m->first_row+end; y++) {
+  const float *grey = &m->grey[(size_t)y * m->width];
+  if (m->grey_half) { from_half(temp, &m->grey_half[(size_t)y * m->width], m->width);  grey = temp; }
+  // interpolate between two rows of the statistics (see build_moments for where the shrunk pixels are)
+  float v = (y+1.0f) / m->scale - 1.0f;
+  int i = v > 0 ? (int)v : 0;
+  float f = v - i;
+  if (f < 0) f = 0;
+  if (i >= m->level_height-1) { i = m->level_height-1; f = 0; }
+  const float *m0 = &m->mean[(size_t)i * w],    *m1 = f > 0 ? m0+w : m0;
+  const float *k0 = &m->inv_std[(size_t)i * w], *k1 = f > 0 ? k0+w : k0;
+  for (int x=0; x<w; x++) { mean[x] = m0[x] + (m1[x]-m0[x])*f;  inv_std[x] = k0[x] + (k1[x]-k0[x])*f; }
+  kernels->upsample_row(grey, mean, inv_std, m->col_index, m->col_weight,
+                        &m->out[(size_t)(y - m->first_row) * m->width], m->width);
+ }
+}
+
+void free_moments(moment_tables *m) {
+ if (m) {
+  free(m->full_rows);
+  free(m->columns);
+  free(m->grey);
+  free(m->grey_half);
+  free(m->col_index);
+  free(m->col_weight);
+  free(m->mean);
+  free(m->inv_std);
+  free(m->scratch);
+ }
+ free(m);
+}
+
+/* Builds the moment tables for an image. Returns NULL if there's not enough memory.
+   With scale > 1, the tables are for the image shrunk that many times, each pixel being the average of a scale x scale block
+   (and the average of grey^2, so the std dev stays right). That's scale^2 times less to store and to look up.
+   The statistics are then blown back up with bilinear interpolation: a box of range r on the shrunk image covers the same pixels
+   as a box of range r*scale around pixel (x+1)*scale-1 of the full image, so that's where shrunk pixel x is taken to be.
+*/
+moment_tables *build_moments(const unsigned char *pixels, int width, int height, int channels, int scale) {
+ moment_tables *m = calloc(1, sizeof(moment_tables));
+ if (!m) return NULL;
+ if (scale < 1) scale = 1;
+ m->width        = width;
+ m->height       = height;
+ m->scale        = scale;
+ m->level_width  = (width +scale-1) / scale;
+ m->level_height = (height+scale-1) / scale;
+ m->stride       = m->level_width+1;
+ m->pixels       = pixels;
+ m->channels     = channels;
+ m->full_rows    = malloc((size_t)m->stride * (m->level_height/TABLE_BAND + 1) * sizeof(moment));
+ m->columns      = big_malloc((size_t)m->level_width * (m->level_height+1) * sizeof(column_moment));
+ m->scratch_size = 8*m->stride + ((width+1) & ~1); // (two table rows and a row of the image, the most any step needs;
+ m->scratch      = malloc(num_threads * m->scratch_size * sizeof(float)); //  even, so the moments line up)
+ if (scale > 1) {
+  if (half_floats) m->grey_half = big_malloc((size_t)width * height * sizeof(half));
+  else             m->grey      = big_malloc((size_t)width * height * sizeof(float));
+  m->col_index  = malloc(width * sizeof(int));
+  m->col_weight = malloc(width * sizeof(float));
+  m->mean       = malloc((size_t)(m->level_width+1) * m->level_height * sizeof(float));
+  m->inv_std    = malloc((size_t)(m->level_width+1) * m->level_height * sizeof(float));
+  if ((!m->grey && !m->grey_half) || !m->col_index || !m->col_weight || !m->mean || !m->inv_std) { free_moments(m); return NULL; }
+  for (int x=0; x<width; x++) {
+   float u = (x+1.0f) / scale - 1.0f;
+   int i = u > 0 ? (int)u : 0;
+   m->col_index[x]  = i < m->level_width-1 ? i : m->level_width-1;
+   m->col_weight[x] = u < 0 || i >= m->level_width-1 ? 0 : u - i;
+  }
+ }
+ if (!m->full_rows || !m->columns || !m->scratch) { free_moments(m); return NULL; }
+ memset(m->full_rows, 0, m->stride * sizeof(moment));                     // the top row of zeros
+ memset(m->columns,   0, m->level_width * sizeof(column_moment));         //
+ int bands = (m->level_height + TABLE_BAND-1) / TABLE_BAND;
+ if (scale > 1) parallel_for(bands, step_shrunk_band_moments, m);
+ else           parallel_for(bands, step_band_moments,        m);
+ if (!quiet) { putchar('.'); fflush(stdout); }
+ parallel_for((m->stride+63) / 64, step_column_moments, m);
+ if (!quiet) { putchar('.'); fflush(stdout); }
+ m->pixels = NULL; // not needed anymore
+ return m;
+}
+
+void shrunk_stats(moment_tables *m, int range) { // m->mean, m->inv_std for this range (when scale > 1)
+ if (m->map_range == range) return; // (they only need working out once per range, on the shrunk image)
+ int range_x = range < m->width/8  ? range : m->width/8;
+ int range_y = range < m->height/8 ? range : m->height/8;
+ m->range_x = (range_x + m->scale/2) / m->scale;
+ m->range_y = (range_y + m->scale/2) / m->scale;
+ if (m->range_x < 1) m->range_x = 1;
+ if (m->range_y < 1) m->range_y = 1;
+ parallel_for(m->level_height, step_shrunk_stats, m);
+ m->map_range = range;
+}
+
+// out := rows y0..y1-1 of the contrast-normalized image (width floats per row), using a box of about 2*range pixels across.
+void normalise(moment_tables *m, int range, float *out, int y0, int y1) {
+ int range_x = range < m->width/8  ? range : m->width/8;   // the box can't be more than 1/4 of the image
+ int range_y = range < m->height/8 ? range : m->height/8;  //
+ m->out = out;
+ m->first_row = y0;
+ if (m->scale > 1) {
+  shrunk_stats(m, range);
+  parallel_for(y1-y0, step_upsample, m);
+  return;
+ }
+ m->range_x = range_x > 1 ? range_x : 1;
+ m->range_y = range_y > 1 ? range_y : 1;
+ parallel_for(y1-y0, step_normalise, m);
+}
+
+/* out := the same, for just the w x h pixels from (x0,y0) (w floats per row); outside the image, its edges carry on.
+   For the loupe's tiles (see the virtual texture), which are small and made one at a time, so it's plain C on one thread.
+*/
+void normalise_rect(moment_tables *m, int range, float *out, int x0, int y0, int w, int h) {
+ int rx = range < m->width/8  ? range : m->width/8;   if (rx < 1) rx = 1;
+ int ry = range < m->height/8 ? range : m->height/8;  if (ry < 1) ry = 1;
+ double inv_area = 0.25 / ((double)rx * ry);
+ int xa = x0 > 0 ? x0 : 0, xb = x0+w < m->width ? x0+w : m->width; // the columns that are in the image
+ if (m->scale > 1) shrunk_stats(m, range);
+ moment *t = (moment*)thread_scratch(m), *b = t + m->stride; // (when scale is 1: the table rows, and the image row)
+ float *here = (float*)(b + m->stride);
+ float *temp = m->grey_half ? here : NULL;                   // (when it isn't: the widened grey, for --half)
+ int top_y = -1, bottom_y = -1, needed = xb+rx < m->width ? xb+rx : m->width; // (the columns the boxes reach)
+ for (int j=0; j<h; j++) {
+  int y = y0+j < 0 ? 0 : y0+j < m->height ? y0+j : m->height-1;
+  float *row = &out[(size_t)j * w];
+  if (m->scale == 1) {
+   int top = y-ry+1 > 0 ? y-ry+1 : 0, bottom = y+ry+1 < m->height ? y+ry+1 : m->height;
+   if (top != top_y)       get_table_row(m, top_y = top,       t, needed);
+   if (bottom != bottom_y) get_table_row(m, bottom_y = bottom, b, needed);
+   get_grey_row(m, y, here);
+   for (int i=0; i<w; i++) { // (as k_normalise_row)
+    int x = x0+i < 0 ? 0 : x0+i < m->width ? x0+i : m->width-1;
+    int left = x-rx+1 > 0 ? x-rx+1 : 0, right = x+rx+1 < m->width ? x+rx+1 : m->width;
+    double s  = b[right].s  - b[left].s  - t[right].s  + t[left].s;
+    double ss = b[right].ss - b[left].ss - t[right].ss + t[left].ss;
+    double g  = here[x];
+    double mu = s * inv_area;
+    float  v  = ss * inv_area - mu*mu;
+    if (v < 1e-6f) v = 1e-6f;
+    row[i] = (float)(g - mu) * (0.5f / sqrtf(v)) + 1.0f;
+   }
+   continue;
+  }
+  // (as step_upsample and k_upsample_row)
+  const float *grey = &m->grey[(size_t)y * m->width];
+  if (temp) { from_half(temp, &m->grey_half[(size_t)y * m->width + xa], xb-xa);  grey = temp - xa; }
+  float v = (y+1.0f) / m->scale - 1.0f;
+  int k = v > 0 ? (int)v : 0;
+  float f = v - k;
+  if (f < 0) f = 0;
+  if (k >= m->level_height-1) { k = m->level_height-1; f = 0; }
+  int stride = m->level_width+1;
+  const float *m0 = &m->mean[(size_t)k * stride],    *m1 = f > 0 ? m0+stride : m0;
+  const float *k0 = &m->inv_std[(size_t)k * stride], *k1 = f > 0 ? k0+stride : k0;
+  for (int i=0; i<w; i++) {
+   int x = x0+i < 0 ? 0 : x0+i < m->width ? x0+i : m->width-1;
+   int c = m->col_index[x];
+   float cf = m->col_weight[x];
+   float mean_a = m0[c]   + (m1[c]  -m0[c])  *f,  mean_b = m0[c+1] + (m1[c+1]-m0[c+1])*f;
+   float k_a    = k0[c]   + (k1[c]  -k0[c])  *f,  k_b    = k0[c+1] + (k1[c+1]-k0[c+1])*f;
+   row[i] = (grey[x] - (mean_a + (mean_b-mean_a)*cf)) * (k_a + (k_b-k_a)*cf) + 1.0f;
+  }
+ }
+}
+
+
+
+
+
+
+/* Streaming pre-processing (--stream), for images too big to keep the tables for.
+   Rows go through once, top to bottom. Only a window of 2*range+1 rows of grey is kept, along with running totals
+   down each column of the rows in the box (a row is added as it comes in and taken off as it leaves the box).
+   Each output row is then one pass across those totals, so memory doesn't depend on the image height.
+   Binary PGM/PPM files are read a row at a time, straight from the file; other formats have to be decoded whole
+   (stb_image can't do part of an image), but then it's 1-4 bytes per pixel rather than 8.
+*/
+typedef struct {
+ FILE *file;            // a binary PGM/PPM ...
+ long data_start;       //
+ unsigned char *pixels; // ... or the whole decoded image
+ int width, height, channels;
+} image_source;
+image_source *source = NULL;
+
+int read_pnm_number(FILE *f) { // skips whitespace and comments; returns -1 if there's no number
+ int c;
+ while ((c = fgetc(f)) != EOF) {
+  if (c == '#') { while ((c = fgetc(f)) != EOF && c != '\n'); }
+  else if (c > ' ') break;
+ }
+ int n = -1;
+ for ( ; c >= '0' && c <= '9'; c = fgetc(f)) n = (n < 0 ? 0 : n*10) + c-'0';
+ return n; // (the one whitespace character after the number has been used up too, as it should)
+}
+
+image_source *open_source(const char *filename) { // returns NULL if it isn't an image
+ image_source *s = calloc(1, sizeof(image_source));
+ if (!s) return NULL;
+ s->file = fopen(filename, "rb");
+ if (s->file) {
+  char magic[2];
+  if (fread(magic, 1, 2, s->file) == 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6')) {
+   s->channels = magic[1] == '6' ? 3 : 1;
+   s->width    = read_pnm_number(s->file);
+   s->height   = read_pnm_number(s->file);
+   int maxval  = read_pnm_number(s->file);
+   s->data_start = ftell(s->file);
+   if (s->width > 0 && s->height > 0 && maxval == 255) return s;
+  }
+  fclose(s->file);
+  s->file = NULL;
+ }
+ s->pixels = stbi_load(filename, &s->width, &s->height, &s->channels, 1); // (see init)
+ s->channels = 1;
+ if (s->pixels) return s;
+ free(s);
+ return NULL;
+}
+void close_source(image_source *s) {
+ if (!s) return;
+ if (s->file) fclose(s->file);
+ stbi_image_free(s->pixels);
+ free(s);
+}
+
+// Runs the whole image through, calling emit() with each row of the contrast-normalized image in turn (0 if out of memory).
+int stream_normalise(image_source *src, int range, void (*emit)(void *ctx, int y, const float *row), void *ctx) {
+ int w = src->width, h = src->height;
+ int rx = range < w/8 ? range : w/8;   if (rx < 1) rx = 1;   // the same box as normalise()
+ int ry = range < h/8 ? range : h/8;   if (ry < 1) ry = 1;   //
+ int window = 2*ry+1;
+ float  *grey    = big_malloc((size_t)window * w * sizeof(float)); // row y is at y % window
+ moment *columns = calloc(w, sizeof(moment));   // totals down each column, of the rows in the box
+ moment *box     = malloc((w+1) * sizeof(moment)); // ... added up across, for k_normalise_row
+ moment *zeros   = calloc(w+1, sizeof(moment));
+ float  *out     = malloc(w * sizeof(float));
+ unsigned char *row = src->file ? malloc((size_t)w * src->channels) : NULL;
+ int ok = grey && columns && box && zeros && out && (row || !src->file);
+ if (ok && src->file) fseek(src->file, src->data_start, SEEK_SET);
+ double inv_area = 0.25 / ((double)rx * ry);
+ for (int y=-ry; ok && y<h; y++) {
+  int in = y+ry; // the row coming into the box
+  if (in < h) {
+   const unsigned char *px = &src->pixels[(size_t)in * w * src->channels];
+   if (src->file) {
+    if (fread(row, src->channels, w, src->file) != (size_t)w) memset(row, 128, (size_t)w * src->channels); // (cut short)
+    px = row;
+   }
+   float *g = &grey[(size_t)(in % window) * w];
+   kernels->greyscale(g, px, src->channels, 0, w);
+   for (int x=0; x<w; x++) { columns[x].s += g[x];  columns[x].ss += (double)g[x]*g[x]; }
+  }
+  if (y < 0) continue;
+  int gone = y-ry; // the row that's just left the box
+  if (gone >= 0) {
+   const float *g = &grey[(size_t)(gone % window) * w];
+   for (int x=0; x<w; x++) { columns[x].s -= g[x];  columns[x].ss -= (double)g[x]*g[x]; }
+  }
+  box[0].s = box[0].ss = 0;
+  for (int x=0; x<w; x++) { box[x+1].s = box[x].s + columns[x].s;  box[x+1].ss = box[x].ss + columns[x].ss; }
+  kernels->normalise_row(zeros, box, &grey[(size_t)(y % window) * w], out, w, rx, inv_area);
+  emit(ctx, y, out);
+ }
+ free(grey); free(columns); free(box); free(zeros); free(out); free(row);
+ return ok;
+}
+
+/* Finding the page, to start the crop corners on (unless there's --crop, or --no-detect).
+   It works on a copy of the image shrunk to about DETECT_SIZE pixels across, contrast-normalised like the real thing.
+   The edges (Sobel) vote for the lines they could be on, each only for angles near its own gradient's (a Hough transform),
+   and the strongest few lines are picked out. Every four of them that make two roughly opposite pairs, and a big enough
+   convex quad, are then scored by how much of the quad's outline really has an edge along it. The image's own sides are
+   candidates too, at a fixed lower score, for pages that run off the photo.
+*/
+#define DETECT_SIZE   400  // pixels across the longest side of the copy
+#define DETECT_LINES  12   // lines taken from the Hough transform (plus the image's 4 sides)
+#define DETECT_ANGLES 180  // 1 degree each
+#define SIDE_SUPPORT  0.3f // score per pixel for an image side (a found edge scores up to 1)
+int detect_page=1;
+int page_found=0;    // then init_crop() starts on found_points
+vec2 found_points[4];
+
+typedef struct { float angle, rho; int side; } page_line; // x cos(angle) + y sin(angle) = rho; side: one of the image's
+
+typedef struct {
+ int width, height;
+ float *gx, *gy;  // the gradient
+ float threshold; // (squared) for an edge
+} page_edges;
+
+int line_crossing(const page_line *a, const page_line *b, vec2 *p) {
+ float ca = cosf(a->angle), sa = sinf(a->angle), cb = cosf(b->angle), sb = sinf(b->angle);
+ float det = ca*sb - cb*sa;
+ if (fabsf(det) < 0.2f) return 0; // (nearly parallel)
+ p->x = (a->rho*sb - b->rho*sa) / det;
+ p->y = (ca*b->rho - cb*a->rho) / det;
+ return 1;
+}
+
+float angle_apart(const page_line *a, const page_line *b) { // 0 to pi/2
+ float d = fabsf(a->angle - b->angle);
+ return d < M_PI/2 ? d : M_PI - d;
+}
+
+// Fits l to the edge pixels along it (least squares, weighted by the edges' strength), for better than the Hough bins.
+void fit_line(const page_edges *e, page_line *l) {
+ float nx = cosf(l->angle), ny = sinf(l->angle);
+ double total = 0, sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+ for (int y=1; y<e->height-1; y++) for (int x=1; x<e->width-1; x++) {
+  float px = x+0.5f, py = y+0.5f;
+  if (fabsf(px*nx + py*ny - l->rho) > 2) continue;
+  float gx = e->gx[y*e->width + x], gy = e->gy[y*e->width + x];
+  float along = gx*nx + gy*ny, m2 = gx*gx + gy*gy;
+  if (m2 <= e->threshold || along*along <= 0.8f*m2) continue;
+  float weight = sqrtf(m2);
+  total += weight;  sx += weight*px;  sy += weight*py;
+  sxx += weight*px*px;  sxy += weight*px*py;  syy += weight*py*py;
+ }
+ if (total <= 0) return;
+ sx /= total;  sy /= total;
+ sxx = sxx/total - sx*sx;  sxy = sxy/total - sx*sy;  syy = syy/total - sy*sy;
+ float angle = 0.5 * atan2(2*sxy, sxx - syy) + M_PI/2; // (the normal, across the direction they spread out in)
+ if (cosf(angle - l->angle) < 0) angle -= M_PI;
+ if (fabsf(angle - l->angle) > 3 * M_PI/180) return; // (it's found something else)
+ l->rho   = sx*cosf(angle) + sy*sinf(angle);
+ l->angle = angle;
+ if (angle < 0) { l->angle += M_PI;  l->rho = -l->rho; } // (keeping to 0-180 degrees)
+}
+
+// How much of the side from p to q (on line l) has an edge along it: up to its length.
+float side_support(const page_edges *e, vec2 p, vec2 q, const page_line *l) {
+ float length = hypotf(q.x-p.x, q.y-p.y);
+ if (l->side) return SIDE_SUPPORT * length;
+ float nx = cosf(l->angle), ny = sinf(l->angle);
+ int n = length, hits = 0;
+ for (int i=0; i<n; i++) {
+  float x = p.x + (q.x-p.x)*(i+0.5f)/n, y = p.y + (q.y-p.y)*(i+0.5f)/n;
+  for (int k=-1; k<=1; k++) { // (a pixel either side, as the line's only as good as the Hough bins)
+   int ix = x + k*nx, iy = y + k*ny;
+   if (ix < 0 || iy < 0 || ix >= e->width || iy >= e->height) continue;
+   float gx = e->gx[iy*e->width + ix], gy = e->gy[iy*e->width + ix];
+   float along = gx*nx + gy*ny, m2 = gx*gx + gy*gy;
+   if (m2 > e->threshold && along*along > 0.8f*m2) { hits++; break; }
+  }
+ }
+ return n > 0 ? hits * length / n : 0;
+}
+
+// corners := the page's corners (crop_points order: bottom left, bottom right, top right, top left). 0 if not found.
+// range: the local_range to normalise with (passed in, since the loader thread can't read the live one).
+int find_page(const unsigned char *pixels, int width, int height, int range, vec2 corners[4]) {
+ double started = now_ms();
+ int longest = width > height ? width : height;
+ int n = (longest + DETECT_SIZE-1) / DETECT_SIZE; // shrinks n times
+ int w = width / n, h = height / n, found = 0;
+ if (w < 16 || h < 16) return 0;
+ if (!quiet) { printf("Looking for the page"); fflush(stdout); }
+ unsigned char *small = malloc((size_t)w * h);
+ float *norm = malloc((size_t)w * h * sizeof(float));
+ page_edges e = { w, h, malloc((size_t)w * h * sizeof(float)), calloc((size_t)w * h, sizeof(float)), 0 };
+ int rhos = 2 * (int)(hypotf(w, h) + 1);
+ float *votes = calloc((size_t)DETECT_ANGLES * rhos, sizeof(float));
+ moment_tables *m = NULL;
+ if (small && norm && e.gx && e.gy && votes) {
+  for (int y=0; y<h; y++) for (int x=0; x<w; x++) { // (n x n block averages)
+   int total = 0;
+   for (int j=0; j<n; j++) for (int i=0; i<n; i++) total += pixels[(size_t)(y*n+j) * width + x*n+i];
+   small[y*w + x] = total / (n*n);
+  }
+  m = build_moments(small, w, h, 1, 1);
+ }
+ if (m) {
+  normalise(m, range/n > 0 ? range/n : 1, norm, 0, h);
+
+  // edges
+  double total = 0;
+  memset(e.gx, 0, (size_t)w * h * sizeof(float));
+  for (int y=1; y<h-1; y++) for (int x=1; x<w-1; x++) {
+   const float *c = &norm[y*w + x];
+   float gx = (c[1-w] + 2*c[1] + c[1+w]) - (c[-1-w] + 2*c[-1] + c[-1+w]);
+   float gy = (c[w-1] + 2*c[w] + c[w+1]) - (c[-w-1] + 2*c[-w] + c[-w+1]);
+   e.gx[y*w + x] = gx;  e.gy[y*w + x] = gy;
+   total += sqrtf(gx*gx + gy*gy);
+  }
+  float threshold = 2.0 * total / ((double)(w-2) * (h-2)); // twice the average
+  e.threshold = threshold * threshold;
+
+  // votes
+  float cosines[DETECT_ANGLES], sines[DETECT_ANGLES];
+  for (int a=0; a<DETECT_ANGLES; a++) { cosines[a] = cos(a * M_PI / DETECT_ANGLES);  sines[a] = sin(a * M_PI / DETECT_ANGLES); }
+  for (int y=1; y<h-1; y++) for (int x=1; x<w-1; x++) {
+   float gx = e.gx[y*w + x], gy = e.gy[y*w + x], m2 = gx*gx + gy*gy;
+   if (m2 <= e.threshold) continue;
+   float angle = atan2f(gy, gx);
+   if (angle < 0) angle += M_PI;
+   int a0 = (int)(angle * (DETECT_ANGLES / M_PI) + 0.5f);
+   for (int da=-2; da<=2; da++) {
+    int a = (a0 + da + DETECT_ANGLES) % DETECT_ANGLES;
+    int r = (int)floorf((x+0.5f)*cosines[a] + (y+0.5f)*sines[a] + 0.5f) + rhos/2;
+    if (r >= 0 && r < rhos) votes[(size_t)a*rhos + r] += sqrtf(m2);
+   }
+  }
+
+  // the strongest lines, each taking its neighbours' votes out of the running
+  page_line lines[DETECT_LINES+4];
+  int count = 0;
+  for (int tries=0; count < DETECT_LINES && tries < 4*DETECT_LINES; tries++) {
+   size_t best = 0;
+   for (size_t i=1; i<(size_t)DETECT_ANGLES*rhos; i++) if (votes[i] > votes[best]) best = i;
+   if (votes[best] <= 0) break;
+   int a = best / rhos, r = best % rhos - rhos/2;
+   lines[count].angle = a * M_PI / DETECT_ANGLES;
+   lines[count].rho   = r;
+   lines[count].side  = 0;
+   fit_line(&e, &lines[count]);
+   for (int da=-4; da<=4; da++) {
+    int a2 = a+da, r2 = r;
+    if (a2 < 0)              { a2 += DETECT_ANGLES;  r2 = -r; } // (the same lines, the other way round)
+    if (a2 >= DETECT_ANGLES) { a2 -= DETECT_ANGLES;  r2 = -r; }
+    for (int dr=-6; dr<=6; dr++) if (r2+dr+rhos/2 >= 0 && r2+dr+rhos/2 < rhos) votes[(size_t)a2*rhos + r2+dr+rhos/2] = 0;
+   }
+   int again = 0; // (a long line's votes spread further than that, so the fitted line can be one we've already got)
+   for (int i=0; i<count; i++) {
+    float flip = fabsf(lines[i].angle - lines[count].angle) > M_PI/2 ? -1 : 1;
+    again |= angle_apart(&lines[i], &lines[count]) < 2 * M_PI/180 && fabsf(lines[i].rho - flip*lines[count].rho) < 3;
+   }
+   if (!again) count++;
+  }
+  page_line sides[4] = { {0, 0, 1}, {0, w, 1}, {M_PI/2, 0, 1}, {M_PI/2, h, 1} };
+  for (int i=0; i<4; i++) lines[count++] = sides[i];
+
+  // pairs of roughly opposite sides, then quads from two pairs
+  int pairs[(DETECT_LINES+4) * (DETECT_LINES+3) / 2][2], pair_count = 0;
+  for (int a=0; a<count; a++) for (int b=a+1; b<count; b++)
+   if (angle_apart(&lines[a], &lines[b]) < 35 * M_PI/180) { pairs[pair_count][0] = a;  pairs[pair_count++][1] = b; }
+  float best_score = 0, margin = 0.02f * (w > h ? w : h);
+  for (int p=0; p<pair_count; p++) for (int q=p+1; q<pair_count; q++) {
+   const page_line *a = &lines[pairs[p][0]], *b = &lines[pairs[p][1]], *c = &lines[pairs[q][0]], *d = &lines[pairs[q][1]];
+   if (a == c || a == d || b == c || b == d || angle_apart(a, c) < 50 * M_PI/180) continue;
+   vec2 k[4]; // going round: a-c, c-b, b-d, d-a
+   if (!line_crossing(a, c, &k[0]) || !line_crossing(c, b, &k[1]) || !line_crossing(b, d, &k[2]) || !line_crossing(d, a, &k[3])) continue;
+   int inside = 1, turns = 0;
+   float area = 0;
+   for (int i=0; i<4; i++) {
+    vec2 u = k[i], v = k[(i+1)%4], t = k[(i+2)%4];
+    inside &= u.x > -margin && u.y > -margin && u.x < w+margin && u.y < h+margin;
+    float cross = (v.x-u.x)*(t.y-v.y) - (v.y-u.y)*(t.x-v.x);
+    turns += cross > 0 ? 1 : -1;
+    area += u.x*v.y - v.x*u.y;
+   }
+   if (!inside || (turns != 4 && turns != -4) || fabsf(area) < 0.2f * 2*w*h) continue; // (area is doubled)
+   const page_line *side[4] = { c, b, d, a }; // (from k[i] to k[i+1])
+   float score = 0, most = 0; // most: if there were an edge all the way round
+   int edges = 0;
+   for (int i=0; i<4; i++) {
+    score += side_support(&e, k[i], k[(i+1)%4], side[i]);
+    most  += (side[i]->side ? SIDE_SUPPORT : 1) * hypotf(k[(i+1)%4].x - k[i].x, k[(i+1)%4].y - k[i].y);
+    edges += !side[i]->side;
+   }
+   if (edges < 2 || score < 0.6f * most || score <= best_score) continue;
+   best_score = score;
+   found = 1;
+   // into crop_points order, in image pixels: the top left is the one nearest the image's top left, then clockwise
+   int first = 0;
+   for (int i=1; i<4; i++) if (k[i].x + k[i].y < k[first].x + k[first].y) first = i;
+   int step = turns > 0 ? 1 : 3; // (y goes down, so a positive turn is clockwise on the screen)
+   for (int i=0; i<4; i++) {
+    vec2 v = k[(first + i*step) % 4];
+    v.x *= n;  v.y *= n;
+    corners[3-i].x = v.x < 0 ? 0 : v.x > width  ? width  : v.x;
+    corners[3-i].y = v.y < 0 ? 0 : v.y > height ? height : v.y;
+   }
+  }
+ }
+ free_moments(m);
+ free(small); free(norm); free(e.gx); free(e.gy); free(votes);
+ if (!quiet) {
+  if (found) printf("\nFound the page (%.0f ms)\n", now_ms() - started);
+  else       printf("\nNo page found, starting from the whole image (%.0f ms)\n", now_ms() - started);
+ }
+ return found;
+}
+
+/* Tiled textures, for images bigger than the graphics card's GL_MAX_TEXTURE_SIZE.
+   The image is cut into a grid of textures. Each tile has step x step texels of its own, plus TILE_BORDER texels from
+   each of its neighbours, so the filtering (and the first few mipmap levels, since step and the border are multiples of 8)
+   comes out the same on both sides of a seam. When the image fits, there's just one tile with no border.
+   Drawing goes through draw_tiled(): each tile draws the whole quad, clipped to the part of the image it owns.
+*/
+#define TILE_BORDER 8
+int tile_size=0; // 0 = as big as the graphics card allows
+int texture_changes=0; // counts update_mipmaps calls, so the pane cache knows when the image has changed
+int use_shaders=0; // draw with the warp shader (--shaders, see init_warp_shader), or else the fixed-function way, with clip planes
+GLuint warp_program, warp_array, warp_buffer;
+GLint  warp_rect, warp_h, warp_own, warp_span; // its uniforms
+struct tiled_texture {
+ int width, height;     // texels, of the whole image (or the preview)
+ int step;              // texels each tile has of its own
+ int columns, rows;     // tiles across and down
+ GLuint *tiles;         // row by row
+};
+
+// The texels of tile i (along one side): [*t0, *t1) are in its texture, [*own0, *own1) are its own.
+void tile_span(const tiled_texture *t, int i, int size, int *t0, int *t1, int *own0, int *own1) {
+ int o0 = i * t->step; // (locals: callers that don't need the own span pass the same int for both)
+ int o1 = o0 + t->step < size ? o0 + t->step : size;
+ int border = t->step < size ? TILE_BORDER : 0;
+ *t0 = o0 - border > 0    ? o0 - border : 0;
+ *t1 = o1 + border < size ? o1 + border : size;
+ *own0 = o0;
+ *own1 = o1;
+}
+
+void set_texture_params() { // more OpenGL stuff, once the texture is filled in
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); // (GL_CLAMP would darken the seams)
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+ if (anisotropy > 1 && glutExtensionSupported("GL_EXT_texture_filter_anisotropic")) {
+  GLfloat most;
+  glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &most);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, anisotropy < most ? anisotropy : most);
+ }
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_RED);
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
+ glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
+}
+
+void free_tiled_texture(tiled_texture *t) {
+ if (!t) return;
+ glDeleteTextures(t->columns * t->rows, t->tiles);
+ free(t->tiles);
+ free(t);
+}
+
+// An empty texture (internal_format GL_R32F or GL_R16F) of width x height texels. Returns NULL if out of memory.
+tiled_texture *new_tiled_texture(GLenum internal_format, int width, int height) {
+ GLint max_size;
+ glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+ if (tile_size > 0 && tile_size < max_size) max_size = tile_size;
+ tiled_texture *t = calloc(1, sizeof(tiled_texture));
+ if (!t) return NULL;
+ t->width  = width;
+ t->height = height;
+ if (width <= max_size && height <= max_size) t->step = width > height ? width : height;
+ else t->step = (max_size - 2*TILE_BORDER) & ~7;
+ if (t->step < 8) t->step = 8;
+ t->columns = (width +t->step-1) / t->step;
+ t->rows    = (height+t->step-1) / t->step;
+ t->tiles = calloc((size_t)t->columns * t->rows, sizeof(GLuint));
+ if (!t->tiles) { free(t); return NULL; }
+ glGenTextures(t->columns * t->rows, t->tiles);
+ for (int j=0; j<t->rows; j++) for (int i=0; i<t->columns; i++) {
+  int x0, x1, y0, y1, own;
+  tile_span(t, i, width,  &x0, &x1, &own, &own);
+  tile_span(t, j, height, &y0, &y1, &own, &own);
+  glBindTexture(GL_TEXTURE_2D, t->tiles[j*t->columns + i]);
+  glTexImage2D(GL_TEXTURE_2D, 0, internal_format, x1-x0, y1-y0, 0, GL_RED, GL_FLOAT, NULL);
+ }
+ if (t->columns * t->rows > 1) printf("Texture split into %d x %d tiles\n", t->columns, t->rows);
+ return t;
+}
+
+// Texels in rows y..y+count-1 := pixels (count whole rows of GL_RED, of the given type), in every tile they're in.
+void tiled_sub_image(tiled_texture *t, int y, int count, GLenum type, const void *pixels) {
+ glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+ glPixelStorei(GL_UNPACK_ROW_LENGTH, t->width);
+ for (int j=0; j<t->rows; j++) {
+  int ty0, y0, y1, own;
+  tile_span(t, j, t->height, &ty0, &y1, &own, &own);
+  y0 = ty0 > y ? ty0 : y;
+  if (y1 > y+count) y1 = y+count;
+  if (y0 >= y1) continue;
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, y0 - y);
+  for (int i=0; i<t->columns; i++) {
+   int x0, x1;
+   tile_span(t, i, t->width, &x0, &x1, &own, &own);
+   glPixelStorei(GL_UNPACK_SKIP_PIXELS, x0);
+   glBindTexture(GL_TEXTURE_2D, t->tiles[j*t->columns + i]);
+   glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y0-ty0, x1-x0, y1-y0, GL_RED, type, pixels);
+  }
+ }
+ glPixelStorei(GL_UNPACK_ROW_LENGTH,  0);
+ glPixelStorei(GL_UNPACK_SKIP_ROWS,   0);
+ glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+}
+
+void update_mipmaps(tiled_texture *t) { // once the texture is filled in
+ texture_changes++;
+ for (int i=0; i<t->columns * t->rows; i++) {
+  glBindTexture(GL_TEXTURE_2D, t->tiles[i]);
+  glGenerateMipmap(GL_TEXTURE_2D);
+  set_texture_params();
+ }
+}
+
+/* Draws the texture onto the rectangle (x0,y0)-(x1,y1) in NDC, warped by h (see quad_homography: the corners of the
+   rectangle, starting at (x0,y0) and going towards x1 first, show the image pixels at the corners of the quad).
+   The texture coordinates are homogeneous, so the perspective comes out exactly, and OpenGL's clip planes keep each
+   tile to the pixels it owns (a line in the image is a line on the screen too, so the planes are exact as well).
+*/
+void draw_tiled(const tiled_texture *t, const double h[3][3], float x0, float y0, float x1, float y1) {
+ double m[3][3]; // h, in texels of t
+ double sx = (double)t->width / image_width, sy = (double)t->height / image_height;
+ double lo_x = 1e30, hi_x = -1e30, lo_y = 1e30, hi_y = -1e30; // the quad's bounding box, for skipping tiles
+ for (int k=0; k<3; k++) { m[0][k] = h[0][k]*sx;  m[1][k] = h[1][k]*sy;  m[2][k] = h[2][k]; }
+ for (int k=0; k<4; k++) {
+  double u = k==1 || k==2, v = k>=2;
+  double w = m[2][0]*u + m[2][1]*v + m[2][2];
+  double x = (m[0][0]*u + m[0][1]*v + m[0][2]) / w, y = (m[1][0]*u + m[1][1]*v + m[1][2]) / w;
+  lo_x = x < lo_x ? x : lo_x;  hi_x = x > hi_x ? x : hi_x;
+  lo_y = y < lo_y ? y : lo_y;  hi_y = y > hi_y ? y : hi_y;
+ }
+ double du = 1.0 / (x1-x0), dv = 1.0 / (y1-y0); // u = (x-x0)*du, v = (y-y0)*dv
+ if (use_shaders) { // only uniforms change from one draw to the next
+  float hm[9];
+  for (int k=0; k<9; k++) hm[k] = m[k/3][k%3];
+  glUseProgram(warp_program);
+  glBindVertexArray(warp_array);
+  glUniform4f(warp_rect, x0, y0, x1, y1);
+  glUniformMatrix3fv(warp_h, 1, GL_TRUE, hm);
+ }
+ else glEnable(GL_TEXTURE_2D);
+ for (int k=0; k<4; k++) glEnable(GL_CLIP_PLANE0+k); // (the same switches as GL_CLIP_DISTANCE0-3, for the shader)
+ for (int j=0; j<t->rows; j++) for (int i=0; i<t->columns; i++) {
+  int tx0, tx1, ty0, ty1, own_x0, own_x1, own_y0, own_y1;
+  tile_span(t, i, t->width,  &tx0, &tx1, &own_x0, &own_x1);
+  tile_span(t, j, t->height, &ty0, &ty1, &own_y0, &own_y1);
+  if (hi_x < own_x0 || lo_x > own_x1 || hi_y < own_y0 || lo_y > own_y1) continue;
+  if (use_shaders) {
+   glBindTexture(GL_TEXTURE_2D, t->tiles[j*t->columns + i]);
+   glUniform4f(warp_own,  own_x0, own_y0, own_x1, own_y1);
+   glUniform4f(warp_span, tx0, ty0, tx1-tx0, ty1-ty0);
+   glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+   continue;
+  }
+  // the planes x >= own_x0, x <= own_x1, etc. (in texels), as a*u + b*v + c >= 0, then in NDC
+  double planes[4][3], eq[4];
+  for (int k=0; k<3; k++) {
+   planes[0][k] =  m[0][k] - own_x0*m[2][k];
+   planes[1][k] = -m[0][k] + own_x1*m[2][k];
+   planes[2][k] =  m[1][k] - own_y0*m[2][k];
+   planes[3][k] = -m[1][k] + own_y1*m[2][k];
+  }
+  for (int k=0; k<4; k++) {
+   eq[0] = planes[k][0]*du;
+   eq[1] = planes[k][1]*dv;
+   eq[2] = 0.0;
+   eq[3] = planes[k][2] - planes[k][0]*x0*du - planes[k][1]*y0*dv;
+   glClipPlane(GL_CLIP_PLANE0+k, eq);
+  }
+  glBindTexture(GL_TEXTURE_2D, t->tiles[j*t->columns + i]);
+  glBegin(GL_QUADS);
+  for (int k=0; k<4; k++) {
+   double u = k==1 || k==2, v = k>=2;
+   double x = m[0][0]*u + m[0][1]*v + m[0][2];
+   double y = m[1][0]*u + m[1][1]*v + m[1][2];
+   double w = m[2][0]*u + m[2][1]*v + m[2][2];
+   glTexCoord4f((x - tx0*w) / (tx1-tx0), (y - ty0*w) / (ty1-ty0), 0.0f, w);
+   glVertex2f(u ? x1 : x0, v ? y1 : y0);
+  }
+  glEnd();
+ }
+ for (int k=0; k<4; k++) glDisable(GL_CLIP_PLANE0+k);
+ if (use_shaders) {
+  glBindVertexArray(0);
+  glUseProgram(0);
+ }
+ else glDisable(GL_TEXTURE_2D);
+}
+
+/* Pre-processing on the graphics card (--gpu).
+   The 8-bit image is uploaded once, as it is, and the rest is done with fragment shaders drawing into textures:
+     shrink:  grey and grey^2, averaged over scale x scale blocks  (like build_moments)
+     box_x:   totals over [x-range+1, x+range] across               (zero outside the image, like the CPU path)
+     box_y:   totals down, then the local average and 0.5/std dev   (still on the shrunk image)
+     finish:  (grey - average) * 0.5/std dev + 1, straight into tex (the averages etc. come through the texture filtering,
+              which does the same bilinear interpolation as step_upsample)
+   Changing the radius only re-runs the last three. The box passes are loops over 2*range/scale texels, so this is meant
+   to go with a shrunk image; at scale 1 it's correct but slow.
+*/
+typedef struct {
+ int width, height, channels;
+ int scale, level_width, level_height;
+ GLuint image;      // the 8-bit image
+ GLuint level[3];   // RG32F, shrunk: (grey, grey^2), totals across, (average, 0.5/std dev)
+ GLuint framebuffer;
+ GLuint quad_array, quad_buffer;      // the quad every pass draws (attribute 0, corner)
+ GLuint shrink, box_x, box_y, finish; // shader programs
+} gpu_tables;
+gpu_tables *gpu_stats = NULL;
+
+#define GLSL(...) "#version 130\n" #__VA_ARGS__
+const char *vertex_shader = GLSL(
+ in vec2 corner;
+ void main() { gl_Position = vec4(corner, 0.0, 1.0); }
+);
+#define GREYSCALE_GLSL(...) GLSL( \
+ uniform sampler2D image; \
+ uniform int colour; \
+ float greyscale(ivec2 p) { /* same as k_greyscale */ \
+  vec3 c = texelFetch(image, p, 0).rgb * 255.0 - 127.5; \
+  return colour != 0 ? 0.299*c.r + 0.587*c.g + 0.114*c.b : c.r; \
+ } \
+ ) #__VA_ARGS__
+const char *shrink_shader = GREYSCALE_GLSL(
+ uniform int scale;
+ uniform ivec2 size;
+ void main() {
+  ivec2 p0 = ivec2(gl_FragCoord.xy) * scale;
+  ivec2 p1 = min(p0 + scale, size);
+  vec2 total = vec2(0.0);
+  for (int y=p0.y; y<p1.y; y++) for (int x=p0.x; x<p1.x; x++) { float g = greyscale(ivec2(x,y));  total += vec2(g, g*g); }
+  gl_FragColor = vec4(total / float((p1.x-p0.x) * (p1.y-p0.y)), 0.0, 1.0);
+ }
+);
+const char *box_x_shader = GLSL(
+ uniform sampler2D level;
+ uniform int range, size;
+ void main() {
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  vec2 total = vec2(0.0);
+  for (int x=max(p.x-range+1, 0); x<min(p.x+range+1, size); x++) total += texelFetch(level, ivec2(x, p.y), 0).rg;
+  gl_FragColor = vec4(total, 0.0, 1.0);
+ }
+);
+const char *box_y_shader = GLSL(
+ uniform sampler2D level;
+ uniform int range, size;
+ uniform float inv_area;
+ void main() {
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  vec2 total = vec2(0.0);
+  for (int y=max(p.y-range+1, 0); y<min(p.y+range+1, size); y++) total += texelFetch(level, ivec2(p.x, y), 0).rg;
+  float m = total.x * inv_area;
+  float v = max(total.y * inv_area - m*m, 1e-6);
+  gl_FragColor = vec4(m, 0.5 / sqrt(v), 0.0, 1.0);
+ }
+);
+const char *finish_shader = GREYSCALE_GLSL(
+ uniform sampler2D stats;
+ uniform float scale;
+ uniform vec2 level_size;
+ uniform ivec2 offset; /* where the tile being drawn starts */
+ void main() {
+  ivec2 p = ivec2(gl_FragCoord.xy) + offset;
+  vec2 u = (vec2(p) + 1.0) / scale - 1.0; // where this pixel is on the shrunk image (see build_moments)
+  vec2 s = texture(stats, (u + 0.5) / level_size).rg;
+  gl_FragColor = vec4((greyscale(p) - s.x) * s.y + 1.0, 0.0, 0.0, 1.0);
+ }
+);
+
+GLuint compile_shaders(const char *name, const char *vertex_source, const char *fragment_source) { // returns 0 if they don't compile
+ GLuint program = glCreateProgram();
+ const char *sources[2] = { vertex_source, fragment_source };
+ GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+ for (int i=0; i<2; i++) {
+  GLuint shader = glCreateShader(types[i]);
+  glShaderSource(shader, 1, &sources[i], NULL);
+  glCompileShader(shader);
+  glAttachShader(program, shader);
+  glDeleteShader(shader); // (it stays until the program goes)
+ }
+ glBindAttribLocation(program, 0, "corner"); // (so one vertex array does for all the passes)
+ glLinkProgram(program);
+ GLint ok;
+ glGetProgramiv(program, GL_LINK_STATUS, &ok);
+ if (!ok) {
+  char log[1024];
+  glGetProgramInfoLog(program, sizeof(log), NULL, log);
+  printf("\nShader '%s' didn't compile: %s", name, log);
+  glDeleteProgram(program);
+  return 0;
+ }
+ return program;
+}
+GLuint compile_program(const char *name, const char *fragment_source) { // with vertex_shader
+ return compile_shaders(name, vertex_shader, fragment_source);
+}
+
+GLuint new_texture(GLenum internal_format, int width, int height, GLenum format, GLenum type, const void *data, GLenum filter) {
+ GLuint t;
+ glGenTextures(1, &t);
+ glBindTexture(GL_TEXTURE_2D, t);
+ glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, data);
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+ return t;
+}
+
+// Draws a pass of a shader program into a texture, reading from one or two others (texture units 0 and 1).
+void gpu_pass(GLuint program, GLuint target, int width, int height, GLuint input0, GLuint input1) {
+ glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, target, 0);
+ glViewport(0, 0, width, height);
+ glUseProgram(program);
+ glActiveTexture(GL_TEXTURE1);  glBindTexture(GL_TEXTURE_2D, input1);
+ glActiveTexture(GL_TEXTURE0);  glBindTexture(GL_TEXTURE_2D, input0);
+ glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+}
+void gpu_begin(gpu_tables *g) {
+ glPushAttrib(GL_VIEWPORT_BIT | GL_ENABLE_BIT);
+ glDisable(GL_BLEND);
+ glDisable(GL_DEPTH_TEST);
+ glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, g->framebuffer);
+ glBindVertexArray(g->quad_array);
+}
+void gpu_end() {
+ glBindVertexArray(0);
+ glUseProgram(0);
+ glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+ glActiveTexture(GL_TEXTURE1);  glBindTexture(GL_TEXTURE_2D, 0);
+ glActiveTexture(GL_TEXTURE0);  glBindTexture(GL_TEXTURE_2D, 0);
+ glPopAttrib();
+}
+
+void free_gpu_tables(gpu_tables *g) {
+ if (!g) return;
+ glDeleteTextures(1, &g->image);
+ glDeleteTextures(3, g->level);
+ glDeleteFramebuffersEXT(1, &g->framebuffer);
+ glDeleteVertexArrays(1, &g->quad_array);
+ glDeleteBuffers(1, &g->quad_buffer);
+ glDeleteProgram(g->shrink);
+ glDeleteProgram(g->box_x);
+ glDeleteProgram(g->box_y);
+ glDeleteProgram(g->finish);
+ free(g);
+}
+
+// Uploads the image and works out the shrunk grey and grey^2. Returns NULL if the graphics card can't do it.
+gpu_tables *build_gpu_tables(const unsigned char *pixels, int width, int height, int channels, int scale) {
+ const char *glsl = (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION);
+ GLint max_size;
+ glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+ if (!glsl || atof(glsl) < 1.3) { printf("\nThe graphics card doesn't have GLSL 1.30."); return NULL; }
+ if (width > max_size || height > max_size) { printf("\nThe image is too big for the graphics card."); return NULL; }
+ gpu_tables *g = calloc(1, sizeof(gpu_tables));
+ if (!g) return NULL;
+ if (scale < 1) scale = 1;
+ g->width        = width;
+ g->height       = height;
+ g->channels     = channels;
+ g->scale        = scale;
+ g->level_width  = (width +scale-1) / scale;
+ g->level_height = (height+scale-1) / scale;
+ g->shrink = compile_program("shrink", shrink_shader);
+ g->box_x  = compile_program("box_x",  box_x_shader);
+ g->box_y  = compile_program("box_y",  box_y_shader);
+ g->finish = compile_program("finish", finish_shader);
+ if (!g->shrink || !g->box_x || !g->box_y || !g->finish) { free_gpu_tables(g); return NULL; }
+
+ static const GLenum formats[5]  = { 0, GL_RED, GL_RG, GL_RGB, GL_RGBA };
+ static const GLenum internal[5] = { 0, GL_R8,  GL_RG8, GL_RGB8, GL_RGBA8 };
+ glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+ g->image = new_texture(internal[channels], width, height, formats[channels], GL_UNSIGNED_BYTE, pixels, GL_NEAREST);
+ for (int i=0; i<3; i++)
+  g->level[i] = new_texture(GL_RG32F, g->level_width, g->level_height, GL_RG, GL_FLOAT, NULL, i==2 ? GL_LINEAR : GL_NEAREST);
+ glGenFramebuffersEXT(1, &g->framebuffer);
+ static const float corners[8] = { -1,-1,  1,-1,  1,1,  -1,1 };
+ glGenVertexArrays(1, &g->quad_array);
+ glBindVertexArray(g->quad_array);
+ glGenBuffers(1, &g->quad_buffer);
+ glBindBuffer(GL_ARRAY_BUFFER, g->quad_buffer);
+ glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+ glEnableVertexAttribArray(0);
+ glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+ glBindVertexArray(0);
+ glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+ glUseProgram(g->shrink);
+ glUniform1i(glGetUniformLocation(g->shrink, "colour"), channels == 3);
+ glUniform1i(glGetUniformLocation(g->shrink, "scale"),  scale);
+ glUniform2i(glGetUniformLocation(g->shrink, "size"),   width, height);
+ glUseProgram(g->finish);
+ glUniform1i(glGetUniformLocation(g->finish, "image"),  0);
+ glUniform1i(glGetUniformLocation(g->finish, "stats"),  1);
+ glUniform1i(glGetUniformLocation(g->finish, "colour"), channels == 3);
+ glUniform1f(glGetUniformLocation(g->finish, "scale"),  scale);
+ glUniform2f(glGetUniformLocation(g->finish, "level_size"), g->level_width, g->level_height);
+
+ gpu_begin(g);
+ gpu_pass(g->shrink, g->level[0], g->level_width, g->level_height, g->image, 0);
+ GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+ gpu_end();
+ if (status != GL_FRAMEBUFFER_COMPLETE_EXT || glGetError() != GL_NO_ERROR) {
+  printf("\nThe graphics card can't draw into float textures.");
+  free_gpu_tables(g);
+  return NULL;
+ }
+ if (!quiet) { putchar('.'); fflush(stdout); }
+ return g;
+}
+
+// target (GL_R32F or GL_R16F, the size of the image) := the contrast-normalized image, using a box of about 2*range pixels across.
+void gpu_normalise(gpu_tables *g, int range, tiled_texture *target) {
+ int range_x = range < g->width/8  ? range : g->width/8;   // the same box as normalise()
+ int range_y = range < g->height/8 ? range : g->height/8;  //
+ range_x = (range_x + g->scale/2) / g->scale;  if (range_x < 1) range_x = 1;
+ range_y = (range_y + g->scale/2) / g->scale;  if (range_y < 1) range_y = 1;
+ glUseProgram(g->box_x);
+ glUniform1i(glGetUniformLocation(g->box_x, "range"), range_x);
+ glUniform1i(glGetUniformLocation(g->box_x, "size"),  g->level_width);
+ glUseProgram(g->box_y);
+ glUniform1i(glGetUniformLocation(g->box_y, "range"), range_y);
+ glUniform1i(glGetUniformLocation(g->box_y, "size"),  g->level_height);
+ glUniform1f(glGetUniformLocation(g->box_y, "inv_area"), 0.25 / ((double)range_x * range_y));
+ gpu_begin(g);
+ gpu_pass(g->box_x,  g->level[1], g->level_width, g->level_height, g->level[0], 0);
+ gpu_pass(g->box_y,  g->level[2], g->level_width, g->level_height, g->level[1], 0);
+ for (int j=0; j<target->rows; j++) for (int i=0; i<target->columns; i++) {
+  int x0, x1, y0, y1, own;
+  tile_span(target, i, target->width,  &x0, &x1, &own, &own);
+  tile_span(target, j, target->height, &y0, &y1, &own, &own);
+  glUseProgram(g->finish);
+  glUniform2i(glGetUniformLocation(g->finish, "offset"), x0, y0);
+  gpu_pass(g->finish, target->tiles[j*target->columns + i], x1-x0, y1-y0, g->image, g->level[2]);
+ }
+ gpu_end();
+}
+
+/* Drawing the panes (and the saved image) with a shader: the quad's corners are a vertex buffer made once, and the fragment
+   shader takes each pixel through h to the image itself, so all that changes from frame to frame is a few uniforms.
+   The tile's share of the image is cut out with clip distances, the same planes as draw_tiled's fixed-function ones
+   (a discard in the fragment shader would shade the whole quad for every tile, and it's the pixels that cost).
+*/
+const char *warp_vertex_shader = GLSL(
+ in vec2 corner;
+ uniform vec4 rect; /* where (0,0) and (1,1) go, in NDC */
+ uniform mat3 h;    /* see draw_tiled: (u,v) to the image, in texels of the texture */
+ uniform vec4 own;  /* the texels this tile draws: x0, y0, x1, y1 */
+ out vec2 uv;
+ void main() {
+  vec3 p = h * vec3(corner, 1.0); /* (x >= own.x etc., times p.z: straight lines across the quad) */
+  gl_ClipDistance[0] = p.x - own.x*p.z;
+  gl_ClipDistance[1] = own.z*p.z - p.x;
+  gl_ClipDistance[2] = p.y - own.y*p.z;
+  gl_ClipDistance[3] = own.w*p.z - p.y;
+  uv = corner;
+  gl_Position = vec4(mix(rect.xy, rect.zw, corner), 0.0, 1.0);
+ }
+);
+const char *warp_shader = GLSL(
+ in vec2 uv;
+ uniform sampler2D tile;
+ uniform mat3 h;
+ uniform vec4 span; /* the texels the tile has: x0, y0, width, height */
+ void main() {
+  vec3 p = h * vec3(uv, 1.0);
+  gl_FragColor = texture(tile, (p.xy / p.z - span.xy) / span.zw);
+ }
+);
+
+void init_warp_shader() { // falls back to the fixed-function way if it can't
+ if (!use_shaders) return;
+ use_shaders = 0;
+ const char *glsl = (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION);
+ if (!glsl || atof(glsl) < 1.3) { printf("Drawing without shaders (the graphics card doesn't have GLSL 1.30)\n"); return; }
+ warp_program = compile_shaders("warp", warp_vertex_shader, warp_shader);
+ if (!warp_program) { printf("\nDrawing without shaders\n"); return; }
+ warp_rect = glGetUniformLocation(warp_program, "rect");
+ warp_h    = glGetUniformLocation(warp_program, "h");
+ warp_own  = glGetUniformLocation(warp_program, "own");
+ warp_span = glGetUniformLocation(warp_program, "span");
+ static const float corners[8] = { 0,0,  1,0,  1,1,  0,1 };
+ GLint corner = glGetAttribLocation(warp_program, "corner");
+ glGenVertexArrays(1, &warp_array);
+ glBindVertexArray(warp_array);
+ glGenBuffers(1, &warp_buffer);
+ glBindBuffer(GL_ARRAY_BUFFER, warp_buffer);
+ glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+ glEnableVertexAttribArray(corner);
+ glVertexAttribPointer(corner, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+ glBindVertexArray(0);
+ glBindBuffer(GL_ARRAY_BUFFER, 0);
+ use_shaders = 1;
+}
+
+// (Re)fills the texture with the contrast-normalized image for the current local_range.
+// It goes a band of rows at a time, so there's never a full-size copy of the image in RAM. Returns 0 if out of memory.
+// With --view-size, the texture is the image shrunk by a power of two (averages of shrink x shrink blocks), so
+// graphics memory stays bounded; the loupe shows the full size, and saving is done on the CPU (see save_full_size).
+#define UPLOAD_ROWS 256
+int view_size=0; // 0 = the whole image
+int view_shrink() {
+ int s = 1, longest = image_width > image_height ? image_width : image_height;
+ while (view_size > 0 && longest > view_size * s && s < UPLOAD_ROWS) s *= 2; // (a band has to shrink to whole rows)
+ return s;
+}
+tiled_texture *new_view_texture() {
+ int s = view_shrink();
+ return new_tiled_texture(half_floats ? GL_R16F : GL_R32F, (image_width+s-1) / s, (image_height+s-1) / s);
+}
+
+typedef struct { float *rows; half *temp; tiled_texture *target; int shrink; } upload_band; // temp is for --half
+upload_band new_upload_band(tiled_texture *target) {
+ upload_band b = { malloc((size_t)image_width * UPLOAD_ROWS * sizeof(float)), NULL, target, view_shrink() };
+ if (half_floats) b.temp = malloc((size_t)image_width * UPLOAD_ROWS * sizeof(half));
+ if (!b.rows || (half_floats && !b.temp)) { free(b.rows);  free(b.temp);  b.rows = NULL; }
+ return b;
+}
+void shrink_rows(upload_band *b, int count) { // the band's first count rows := themselves, shrunk (in place)
+ int n = b->shrink, w = b->target->width;
+ for (int y=0; y*n < count; y++) {
+  int rows = count - y*n < n ? count - y*n : n;
+  float *out = &b->rows[(size_t)y * w];
+  for (int x=0; x<w; x++) { // (each block comes after the pixel it goes into, so nothing is overwritten before it's used)
+   int cols = image_width - x*n < n ? image_width - x*n : n;
+   float total = 0;
+   for (int j=0; j<rows; j++) for (int i=0; i<cols; i++) total += b->rows[(size_t)(y*n+j) * image_width + x*n+i];
+   out[x] = total / (rows*cols);
+  }
+ }
+}
+void upload_rows(upload_band *b, int y, int count) { // target rows y.. := the first count rows of the band
+ if (b->shrink > 1) { // (y is a multiple of UPLOAD_ROWS, so of shrink too)
+  shrink_rows(b, count);
+  y /= b->shrink;
+  count = (count + b->shrink-1) / b->shrink;
+ }
+ if (b->temp) {
+  to_half(b->temp, b->rows, b->target->width * count);
+  tiled_sub_image(b->target, y, count, GL_HALF_FLOAT, b->temp);
+ }
+ else tiled_sub_image(b->target, y, count, GL_FLOAT, b->rows);
+}
+void upload_streamed_row(void *band, int y, const float *row) { // collects rows from stream_normalise, a band at a time
+ upload_band *b = band;
+ memcpy(&b->rows[(size_t)(y % UPLOAD_ROWS) * image_width], row, image_width * sizeof(float));
+ if (y % UPLOAD_ROWS == UPLOAD_ROWS-1 || y == image_height-1) upload_rows(b, y - y % UPLOAD_ROWS, y % UPLOAD_ROWS + 1);
+}
+
+int upload_normalised() {
+ if (source) {
+  upload_band b = new_upload_band(tex);
+  int ok = b.rows && stream_normalise(source, local_range, upload_streamed_row, &b);
+  free(b.rows);
+  free(b.temp);
+  if (ok) update_mipmaps(tex);
+  return ok;
+ }
+ if (gpu_stats) {
+  gpu_normalise(gpu_stats, local_range, tex);
+  update_mipmaps(tex);
+  return 1;
+ }
+ upload_band b = new_upload_band(tex);
+ if (!b.rows) return 0;
+ for (int y=0; y<image_height; y+=UPLOAD_ROWS) {
+  int y1 = y+UPLOAD_ROWS < image_height ? y+UPLOAD_ROWS : image_height;
+  normalise(stats, local_range, b.rows, y, y1);
+  upload_rows(&b, y, y1-y);
+ }
+ free(b.rows);
+ free(b.temp);
+ update_mipmaps(tex);
+ return 1;
+}
+
+// out := the whole of t (width x height floats), read back from the graphics card.
+void read_tiled(const tiled_texture *t, float *out) {
+ glPixelStorei(GL_PACK_ALIGNMENT, 1);
+ glPixelStorei(GL_PACK_ROW_LENGTH, t->width);
+ for (int j=0; j<t->rows; j++) for (int i=0; i<t->columns; i++) { // (the borders are read twice, the same both times)
+  int x0, x1, y0, y1, own;
+  tile_span(t, i, t->width,  &x0, &x1, &own, &own);
+  tile_span(t, j, t->height, &y0, &y1, &own, &own);
+  glBindTexture(GL_TEXTURE_2D, t->tiles[j*t->columns + i]);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, &out[(size_t)y0*t->width + x0]);
+ }
+ glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+}
+
+// Compares what the graphics card put in tex with what the CPU gets, and prints how far apart they are.
+void compare_with_cpu() {
+ size_t n = (size_t)image_width * image_height;
+ float *gpu = malloc(n * sizeof(float));
+ float *band = malloc((size_t)image_width * UPLOAD_ROWS * sizeof(float));
+ if (!gpu || !band) { printf("\nNot enough memory to compare with the CPU."); free(gpu); free(band); return; }
+ read_tiled(tex, gpu);
+ double total = 0;
+ float largest = 0;
+ size_t off = 0; // pixels that would come out more than 1 grey level different
+ for (int y=0; y<image_height; y+=UPLOAD_ROWS) {
+  int y1 = y+UPLOAD_ROWS < image_height ? y+UPLOAD_ROWS : image_height;
+  normalise(stats, local_range, band, y, y1);
+  for (size_t i=0; i<(size_t)image_width*(y1-y); i++) {
+   float a = gpu[(size_t)y*image_width + i], b = band[i];
+   float d = a > b ? a-b : b-a;
+   total += d;
+   if (d > largest) largest = d;
+   a = a < 0 ? 0 : a > 1 ? 1 : a;
+   b = b < 0 ? 0 : b > 1 ? 1 : b;
+   if (a-b > 1.0f/255 || b-a > 1.0f/255) off++;
+  }
+ }
+ printf("\nGPU vs CPU: mean difference %.2g, largest %.2g, %zu pixels more than 1 grey level apart (%.4f%%) - %s",
+        total / n, largest, off, 100.0 * off / n, off <= n/1000 ? "OK" : "MISMATCH");
+ free(gpu);
+ free(band);
+}
+
+void init_crop() {
+ if (crop_given) memcpy(crop_points, start_crop_points, sizeof(crop_points));
+ else if (page_found) memcpy(crop_points, found_points, sizeof(crop_points));
+ else reset_crop_points();
+ update_crop();
+}
+// A quick preview: JPEGs decode at 1/8 size in a fraction of the time, so normalise that with the radius scaled to match.
+// Returns NULL for other formats (they'd take as long as the real thing), without decoding them.
+float *make_preview(int range, int *w, int *h) {
+ int full_width, full_height, n;
+ unsigned char magic[2];
+ FILE *f = fopen(input_filename, "rb");
+ if (!f) return NULL;
+ int jpeg = fread(magic, 1, 2, f) == 2 && magic[0] == 0xFF && magic[1] == 0xD8; // (the scale only applies to JPEGs)
+ fclose(f);
+ if (!jpeg || !stbi_info(input_filename, &full_width, &full_height, &n)) return NULL;
+ stbi_set_jpeg_scale_on_load(8);
+ unsigned char *px = stbi_load(input_filename, w, h, &n, 1);
+ stbi_set_jpeg_scale_on_load(1);
+ if (!px) return NULL;
+ float *out = NULL;
+ moment_tables *m = NULL;
+ if (*w < full_width) {
+  m = build_moments(px, *w, *h, 1, 1);
+  out = malloc((size_t)*w * *h * sizeof(float));
+ }
+ if (!m) { free(out); out = NULL; }
+ if (out) normalise(m, range/8 > 0 ? range/8 : 1, out, 0, *h);
+ free_moments(m);
+ stbi_image_free(px);
+ return out;
+}
+void upload_preview(float *out, int w, int h) {
+ tiled_texture *t = new_tiled_texture(GL_R32F, w, h);
+ if (t) {
+  tiled_sub_image(t, 0, h, GL_FLOAT, out);
+  update_mipmaps(t);
+  free_tiled_texture(tex);
+  tex = t;
+ }
+ free(out);
+}
+
+/* Loading in the background.
+   The window comes up as soon as the image's header has been read, with a blank page the operator can already place crop corners on.
+   A loader thread makes the preview, then decodes and pre-processes the full image; it only touches memory, never OpenGL.
+   poll_loader() runs on a GLUT timer in the main thread: it uploads the preview, then the full image a band at a time
+   (so the window stays responsive), and swaps the full-size texture in when it's complete.
+   The loader thread is the only user of the worker pool until it's finished. It gets the radius as it was when it
+   started (local_range changes under it with +/-), and only poll_loader() reads the live one.
+*/
+enum { LOAD_STARTED, LOAD_DECODED, LOAD_FAILED };
+pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+int            load_stage = LOAD_STARTED; // these are handed over under load_mutex
+float         *loaded_preview;
+int            loaded_preview_width, loaded_preview_height;
+unsigned char *loaded_pixels; // kept for the GPU, which can only be used from the main thread
+moment_tables *loaded_stats;
+vec2           loaded_corners[4];
+int            loaded_page; // found the page, at loaded_corners
+int loading=0;      // still waiting for the loader, or still uploading
+tiled_texture *full_tex; // the full-size texture, while it's being uploaded
+upload_band full_band;
+int full_next_row;
+
+void *load_in_background(void *arg) {
+ int range = (int)(intptr_t)arg;
+ int w, h, n;
+ float *preview = make_preview(range, &w, &h);
+ if (preview) {
+  pthread_mutex_lock(&load_mutex);
+  loaded_preview        = preview;
+  loaded_preview_width  = w;
+  loaded_preview_height = h;
+  pthread_mutex_unlock(&load_mutex);
+ }
+ unsigned char *px = stbi_load(input_filename, &w, &h, &n, 1); // just grey (for JPEGs, that's just the Y channel)
+ vec2 corners[4];
+ int found = px && detect_page && !crop_given && find_page(px, w, h, range, corners);
+ moment_tables *m = NULL;
+ if (px && (!use_gpu || check_gpu)) // (--check-gpu compares at the GPU's scale)
+  m = build_moments(px, w, h, 1, stats_scale ? stats_scale : use_gpu ? 8 : 1);
+ if (px && !use_gpu) { stbi_image_free(px); px = NULL; } // we don't need the original image data anymore
+ pthread_mutex_lock(&load_mutex);
+ loaded_pixels = px;
+ loaded_stats  = m;
+ loaded_page   = found;
+ if (found) memcpy(loaded_corners, corners, sizeof(corners));
+ load_stage    = px || m ? LOAD_DECODED : LOAD_FAILED;
+ pthread_mutex_unlock(&load_mutex);
+ return arg;
+}
+
+// Everything's on the graphics card: swap the full-size texture in, keeping the crop corners where they are.
+void finish_loading() {
+ update_mipmaps(full_tex);
+ free_tiled_texture(tex);
+ tex = full_tex;
+ full_tex = NULL;
+ free(full_band.rows);
+ free(full_band.temp);
+ if (gpu_stats && stats) { // --check-gpu
+  compare_with_cpu();
+  free_moments(stats);
+  stats = NULL;
+ }
+ image_data = (unsigned char*)&tex; // (just says there's an image, from here on)
+ loading = 0;
+ printf("Done (%d ms).\n", glutGet(GLUT_ELAPSED_TIME));
+ glutPostRedisplay();
+}
+
+void poll_loader(int value) {
+ pthread_mutex_lock(&load_mutex);
+ float *preview = loaded_preview;
+ loaded_preview = NULL;
+ int stage = load_stage;
+ load_stage = LOAD_STARTED; // (each stage is handled once)
+ pthread_mutex_unlock(&load_mutex);
+
+ if (preview) {
+  upload_preview(preview, loaded_preview_width, loaded_preview_height);
+  printf("Preview ready (%d ms)\n", glutGet(GLUT_ELAPSED_TIME));
+  glutPostRedisplay();
+ }
+ if (stage == LOAD_FAILED) {
+  printf("Failed.\n");
+  loading = 0;
+  glutPostRedisplay();
+  return;
+ }
+ if (stage == LOAD_DECODED) {
+  if (loaded_page) { // start the crop on the page, unless the operator's already moved a corner
+   vec2 whole[4];
+   memcpy(whole, crop_points, sizeof(whole));
+   reset_crop_points();
+   int untouched = !memcmp(whole, crop_points, sizeof(whole));
+   memcpy(found_points, loaded_corners, sizeof(found_points));
+   page_found = 1;
+   if (untouched) init_crop();
+   else { memcpy(crop_points, whole, sizeof(whole));  update_crop(); }
+   glutPostRedisplay();
+  }
+  stats = loaded_stats;
+  if (use_gpu && !(gpu_stats = build_gpu_tables(loaded_pixels, image_width, image_height, 1, stats_scale ? stats_scale : 8))) {
+   printf("Using the CPU instead\n");
+   if (!stats) stats = build_moments(loaded_pixels, image_width, image_height, 1, stats_scale ? stats_scale : 1);
+  }
+  stbi_image_free(loaded_pixels);
+  full_tex = new_view_texture();
+  full_band = new_upload_band(full_tex);
+  if ((!stats && !gpu_stats) || !full_band.rows || !full_tex) {
+   printf("Not enough memory to pre-process the image.\n");
+   free_tiled_texture(full_tex);
+   full_tex = NULL;
+   loading = 0;
+   glutPostRedisplay();
+   return;
+  }
+  full_next_row = 0;
+ }
+ if (full_tex && loading) {
+  if (gpu_stats) {
+   gpu_normalise(gpu_stats, local_range, full_tex);
+   finish_loading();
+   return;
+  }
+  int y = full_next_row, y1 = y+UPLOAD_ROWS < image_height ? y+UPLOAD_ROWS : image_height;
+  normalise(stats, local_range, full_band.rows, y, y1);
+  upload_rows(&full_band, y, y1-y);
+  full_next_row = y1;
+  if (full_next_row >= image_height) {
+   finish_loading();
+   return;
+  }
+ }
+ glutTimerFunc(full_tex ? 0 : 10, poll_loader, value);
+}
+
+void draw();
+void init() {
+ glActiveTexture(GL_TEXTURE0);
+ init_warp_shader();
+ printf("Loading %s...\n", input_filename);
+ int nChannels;
+ if (stream_input) {
+  textGL("Loading image...",0);  flush();
+  int w, h;
+  float *preview = make_preview(local_range, &w, &h);
+  if (preview) upload_preview(preview, w, h);
+  source = open_source(input_filename);
+  if (source) {
+   image_width  = source->width;
+   image_height = source->height;
+   printf("Input resolution: %d x %d pixels\n", image_width, image_height);
+   if (source->pixels && detect_page && !crop_given) page_found = find_page(source->pixels, image_width, image_height, local_range, found_points);
+   if (preview) {
+    image_data = (unsigned char*)source;
+    init_crop();
+    draw();
+    image_data = NULL;
+   }
+   printf("Pre-processing the image, streamed %s", source->file ? "from the file" : "from the decoded image"); fflush(stdout);
+   if (!preview) { textGL("Pre-processing the image...",0); flush(); }
+   free_tiled_texture(tex);
+   tex = new_view_texture();
+   if (!tex || !upload_normalised()) {
+    printf("\nNot enough memory to pre-process the image.\n");
+    return;
+   }
+   image_data = (unsigned char*)source; // (just says there's an image, from here on)
+   init_crop();
+   printf("\nDone.\n");
+  }
+  else printf("Failed.\n");
+  return;
+ }
+ if (!stbi_info(input_filename, &image_width, &image_height, &nChannels)) {
+  printf("Failed.\n");
+  return;
+ }
+ printf("Input resolution: %d x %d pixels\n", image_width, image_height);
+ // a blank page to start with
+ float white = 1.0f;
+ tex = new_tiled_texture(GL_R32F, 1, 1);
+ if (!tex) return;
+ tiled_sub_image(tex, 0, 1, GL_FLOAT, &white);
+ update_mipmaps(tex);
+ init_crop();
+ pthread_t thread;
+ if (pthread_create(&thread, NULL, load_in_background, (void*)(intptr_t)local_range)) {
+  printf("Couldn't start the loader.\n");
+  return;
+ }
+ pthread_detach(thread);
+ loading = 1;
+ glutTimerFunc(0, poll_loader, 0);
+}
+
+
+
+
+
+/* Renders the cropped image (h: see quad_homography) and saves it as a PNG, width x height pixels.
+   It goes a band of rows at a time, and each band a tile at a time through a small offscreen buffer, so the output can
+   be bigger than GL_MAX_VIEWPORT_DIMS, and the memory it takes doesn't depend on the output size. Each tile draws the
+   same quad, placed so that the tile's part of the output lands on the buffer.
+   The bands are read back into two pixel buffer objects in turn: while the PNG encoder works on one band, the graphics
+   card is rendering and copying the next one into the other, so saving takes about as long as the slower of the two.
+   Returns 0 if the graphics card can't do it, or the file can't be written.
+*/
+#define SAVE_TILE_SIZE  2048
+#define SAVE_BAND_BYTES (16<<20)
+int save_output(const double h[3][3], int width, int height, const char *filename) {
+ GLint max_viewport[2], max_buffer;
+ glGetIntegerv(GL_MAX_VIEWPORT_DIMS, max_viewport);
+ glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE_EXT, &max_buffer);
+ int tile_w = SAVE_TILE_SIZE, tile_h = SAVE_TILE_SIZE;
+ if (tile_w > max_viewport[0]) tile_w = max_viewport[0];
+ if (tile_h > max_viewport[1]) tile_h = max_viewport[1];
+ if (tile_w > max_buffer)      tile_w = max_buffer;
+ if (tile_h > max_buffer)      tile_h = max_buffer;
+ if (tile_h > SAVE_BAND_BYTES / width) tile_h = SAVE_BAND_BYTES / width > 0 ? SAVE_BAND_BYTES / width : 1;
+ if (tile_w > width)  tile_w = width;  // (no bigger than it needs to be)
+ if (tile_h > height) tile_h = height; //
+
+ // set up an offscreen buffer, one channel if the graphics card can draw into that
+ GLuint fb; // frame buffer
+ GLuint rb; // render buffer
+ glGenFramebuffersEXT(1, &fb);
+ glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fb);
+ glGenRenderbuffersEXT(1, &rb);
+ glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, rb);
+ glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_R8, tile_w, tile_h);
+ glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, rb);
+ GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+ if (status != GL_FRAMEBUFFER_COMPLETE_EXT) {
+  glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, tile_w, tile_h);
+  status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+ }
+ stbi_png_stream *png = status == GL_FRAMEBUFFER_COMPLETE_EXT ? stbi_write_png_begin(filename, width, height, 1) : NULL;
+ GLuint pbo[2];
+ glGenBuffers(2, pbo);
+ for (int i=0; i<2; i++) {
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+  glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * tile_h, NULL, GL_STREAM_READ);
+ }
+ int ok = png != NULL;
+ if (ok) {
+  glViewport(0, 0, tile_w, tile_h);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glPixelStorei(GL_PACK_ROW_LENGTH, width);
+  for (int y=0, band=0; ok && y < height + tile_h; y+=tile_h, band++) { // (one more time round, to write the last band)
+   if (y < height) { // render this band, and start copying it into a buffer
+    int rows = height-y < tile_h ? height-y : tile_h;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[band & 1]);
+    for (int x=0; x<width; x+=tile_w) {
+     int cols = width-x < tile_w ? width-x : tile_w;
+     float x0 = -1.0f - 2.0f*x/tile_w, y0 = -1.0f - 2.0f*y/tile_h; // where the whole output goes, in the tile's NDC
+     glClear(GL_COLOR_BUFFER_BIT);
+     draw_tiled(tex, h, x0, y0, x0 + 2.0f*width/tile_w, y0 + 2.0f*height/tile_h);
+     glReadPixels(0,0, cols, rows, GL_RED, GL_UNSIGNED_BYTE, (void*)(intptr_t)x); // (an offset into the buffer)
+    }
+   }
+   if (band > 0) { // meanwhile, write the one before it
+    int last_y = y - tile_h, rows = height-last_y < tile_h ? height-last_y : tile_h;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[(band-1) & 1]);
+    const unsigned char *px = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    ok = px && stbi_write_png_rows(png, px, rows, width);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+   }
+  }
+  glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+ }
+ if (!stbi_write_png_end(png)) ok = 0;
+ if (status != GL_FRAMEBUFFER_COMPLETE_EXT) printf("The graphics card can't render the output.\n");
+ else if (!ok) printf("Couldn't write %s\n", filename);
+
+ // delete the buffers, reset openGL to using the default ones
+ glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+ glDeleteBuffers(2, pbo);
+ glDeleteRenderbuffersEXT(1, &rb);
+ glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0); // unbind
+ glDeleteFramebuffersEXT(1, &fb);
+ return ok;
+}
+
+/* The perspective warp on the CPU, for saving without a display (-o): the same as the graphics card does in save_output(),
+   clamp-to-edge, trilinear mipmapping and all, so either way the output comes out the same to within a grey level or so.
+   The pre-processed image and its mipmaps are kept in RAM as floats (4/3 the size of the image).
+*/
+int bilinear_only=0; // sample just the full-size image, like GL_LINEAR (faster, but shrinking the image makes it grainy)
+int check_warp=0;    // after saving with the graphics card, warp on the CPU too and print how much they differ
+
+void free_mip_pyramid(mip_pyramid *p) {
+ if (!p) return;
+ free(p->pixels);
+ free(p);
+}
 
-void recalc_crop_aspect() {
- crop_aspect.x = sqrtf(0.5f*( (crop_points[0].x - crop_points[1].x) * (crop_points[0].x - crop_points[1].x)
-                            + (crop_points[0].y - crop_points[1].y) * (crop_points[0].y - crop_points[1].y)
-                            + (crop_points[2].x - crop_points[3].x) * (crop_points[2].x - crop_points[3].x)
-                            + (crop_points[2].y - crop_points[3].y) * (crop_points[2].y - crop_points[3].y)));
- crop_aspect.y = sqrtf(0.5f*( (crop_points[0].x - crop_points[3].x) * (crop_points[0].x - crop_points[3].x)
-                            + (crop_points[0].y - crop_points[3].y) * (crop_points[0].y - crop_points[3].y)
-                            + (crop_points[2].x - crop_points[1].x) * (crop_points[2].x - crop_points[1].x)
-                            + (crop_points[2].y - crop_points[1].y) * (crop_points[2].y - crop_points[1].y)));
+void mip_size(const mip_pyramid *p, int l, int *w, int *h) { // of level l
+ *w = p->width  >> l > 1 ? p->width  >> l : 1;
+ *h = p->height >> l > 1 ? p->height >> l : 1;
 }
 
-void reset_crop_points() {
- crop_points[0].x = 0.0f;         crop_points[0].y = image_height;
- crop_points[1].x = image_width;  crop_points[1].y = image_height;
- crop_points[2].x = image_width;  crop_points[2].y = 0.0f;
- crop_points[3].x = 0.0f;         crop_points[3].y = 0.0f;
+// The levels for a width x height image, all unfilled. Returns NULL if out of memory.
+mip_pyramid *new_mip_pyramid(int width, int height) {
+ mip_pyramid *p = calloc(1, sizeof(mip_pyramid));
+ if (!p) return NULL;
+ p->width  = width;
+ p->height = height;
+ size_t size = 0;
+ int w, h;
+ do {
+  mip_size(p, p->levels, &w, &h);
+  p->offset[p->levels++] = size;
+  size += (size_t)w * h;
+ } while ((w > 1 || h > 1) && p->levels < MAX_MIP_LEVELS);
+ p->pixels = big_malloc(size * sizeof(float));
+ if (!p->pixels) { free(p); return NULL; }
+ return p;
 }
 
+typedef struct {
+ mip_pyramid *p;
+ int level;
+} mip_job;
+
+void step_downsample(void *ctx, int begin, int end) { // level rows begin..end-1 := 2x2 averages of the level above
+ mip_job *j = ctx;
+ mip_pyramid *p = j->p;
+ int l = j->level, w, h, src_w, src_h;
+ mip_size(p, l, &w, &h);
+ mip_size(p, l-1, &src_w, &src_h);
+ int dx = src_w > 1, dy = src_h > 1 ? src_w : 0; // (a side that's down to 1 pixel stays that way)
+ for (int y=begin; y<end; y++) {
+  const float *in = &p->pixels[p->offset[l-1] + (size_t)y*(dy ? 2 : 1)*src_w];
+  float *out = &p->pixels[p->offset[l] + (size_t)y*w];
+  for (int x=0; x<w; x++) {
+   const float *t = &in[x*(dx+1)];
+   out[x] = 0.25f * (t[0] + t[dx] + t[dy] + t[dy+dx]);
+  }
+ }
+}
 
-/* Conversion functions for different coordinate systems:
-    WPC - window pixel coords
-    IPC - image pixel coords
-    TXC - texture coords (OpenGL)
-    NDC - normalized device coords (OpenGL)
-*/
-vec2 wpc2ipc(vec2 coord) {
- coord.x -= _viewport_x/4;
- coord.y -= _viewport_y/2;
- coord.x *= wpc2ipc_scale;
- coord.y *= wpc2ipc_scale;
- coord.x += image_width/2;
- coord.y += image_height/2;
- return coord;
+void update_cpu_mipmaps(mip_pyramid *p) { // once level 0 is filled in
+ mip_job j = { p, 0 };
+ for (j.level=1; j.level < p->levels; j.level++) parallel_for(p->height >> j.level > 1 ? p->height >> j.level : 1, step_downsample, &j);
 }
-vec2 ipc2wpc(vec2 coord) {
- coord.x -= image_width/2;
- coord.y -= image_height/2;
- coord.x /= wpc2ipc_scale;
- coord.y /= wpc2ipc_scale;
- coord.x += _viewport_x/4;
- coord.y += _viewport_y/2;
- return coord; 
+
+void pyramid_row(void *p, int y, const float *row) { // collects rows from stream_normalise
+ mip_pyramid *m = p;
+ memcpy(&m->pixels[(size_t)y * m->width], row, m->width * sizeof(float));
 }
-vec2 wpc2ndc(vec2 coord) {
- coord.x = coord.x *  2.0f/_viewport_x - 1.0f;
- coord.y = coord.y * -2.0f/_viewport_y + 1.0f;
- return coord;
+
+typedef struct {
+ const mip_pyramid *p;
+ const double (*h)[3];
+ int width, height; // of the whole output
+ int first_row;
+ unsigned char *out;
+} warp_job;
+
+void step_warp(void *ctx, int begin, int end) {
+ warp_job *j = ctx;
+ for (int r=begin; r<end; r++) {
+  double u = 0.5 / j->width, v = (j->first_row + r + 0.5) / j->height; // (the middle of the row's first pixel)
+  float start[3], step[3], down[3];
+  for (int k=0; k<3; k++) {
+   start[k] = j->h[k][0]*u + j->h[k][1]*v + j->h[k][2];
+   step[k]  = j->h[k][0] / j->width;
+   down[k]  = j->h[k][1] / j->height;
+  }
+  kernels->warp_row(j->p, start, step, down, !bilinear_only, anisotropy, &j->out[(size_t)r * j->width], j->width);
+ }
 }
-vec2 ipc2txc(vec2 coord) {
- coord.x /= image_width;
- coord.y /= image_height;
- return coord;
+
+// out := rows y0..y1-1 of the cropped image, width x height pixels in all, where h (see quad_homography) takes the
+// output's (0,0)..(1,1) to the image, top left first. One byte per pixel.
+void warp_image(const mip_pyramid *p, const double h[3][3], int width, int height, int y0, int y1, unsigned char *out) {
+ warp_job j = { p, h, width, height, y0, out };
+ parallel_for(y1-y0, step_warp, &j);
 }
 
+// Saves the cropped image as a PNG, a band of rows at a time.
+// Returns 1, or 0 if the file can't be written, or -1 if there's not enough memory (without saying so: that's up to the caller).
+int save_warped(const mip_pyramid *p, const double h[3][3], int width, int height, const char *filename) {
+ int band = SAVE_BAND_BYTES / width > 0 ? SAVE_BAND_BYTES / width : 1;
+ if (band > height) band = height;
+ unsigned char *rows = malloc((size_t)width * band);
+ if (!rows) return -1;
+ stbi_png_stream *png = stbi_write_png_begin(filename, width, height, 1);
+ int ok = png != NULL;
+ for (int y=0; ok && y<height; y+=band) {
+  int y1 = y+band < height ? y+band : height;
+  warp_image(p, h, width, height, y, y1, rows);
+  ok = stbi_write_png_rows(png, rows, y1-y, width);
+ }
+ if (!stbi_write_png_end(png)) ok = 0;
+ if (!ok && !quiet) printf("Couldn't write %s\n", filename);
+ free(rows);
+ return ok;
+}
 
+/* The whole thing without a window, for one image: load, pre-process, crop and save.
+   corners (crop_points order) is where to crop, or NULL to find the page (or take the whole image, with --no-detect).
+   It only touches its own memory (and prints nothing, with quiet), so --batch can run one of these on each core;
+   the pre-processing still shares out its rows over the worker pool, for -o.
+*/
+enum { FIX_OK, FIX_UNREADABLE, FIX_NO_MEMORY, FIX_UNWRITABLE };
+typedef struct {
+ int in_width, in_height, out_width, out_height;
+ int page_found;
+} fix_report;
+
+int fix_file(const char *input, const char *output, const vec2 *corners, fix_report *r) {
+ memset(r, 0, sizeof(*r));
+ vec2 points[4];
+ mip_pyramid *p = NULL;
+ if (stream_input) {
+  image_source *s = open_source(input);
+  if (!s) return FIX_UNREADABLE;
+  r->in_width  = s->width;
+  r->in_height = s->height;
+  if (!corners && s->pixels && detect_page) r->page_found = find_page(s->pixels, s->width, s->height, local_range, points);
+  p = new_mip_pyramid(s->width, s->height);
+  if (p && !stream_normalise(s, local_range, pyramid_row, p)) { free_mip_pyramid(p); p = NULL; }
+  close_source(s);
+ }
+ else {
+  int n;
+  unsigned char *px = stbi_load(input, &r->in_width, &r->in_height, &n, 1);
+  if (!px) return FIX_UNREADABLE;
+  if (!corners && detect_page) r->page_found = find_page(px, r->in_width, r->in_height, local_range, points);
+  if (!quiet) { printf("Pre-processing the image"); fflush(stdout); }
+  moment_tables *m = build_moments(px, r->in_width, r->in_height, 1, stats_scale ? stats_scale : 1);
+  stbi_image_free(px);
+  p = m ? new_mip_pyramid(r->in_width, r->in_height) : NULL;
+  if (p) normalise(m, local_range, p->pixels, 0, r->in_height);
+  free_moments(m);
+  if (!quiet) printf("\n");
+ }
+ if (!p) return FIX_NO_MEMORY;
+ if (!quiet) printf("Input resolution: %d x %d pixels\n", r->in_width, r->in_height);
+ update_cpu_mipmaps(p);
+ if (corners) memcpy(points, corners, sizeof(points));
+ else if (!r->page_found) { // the whole image
+  points[0].x = 0.0f;          points[0].y = r->in_height;
+  points[1].x = r->in_width;   points[1].y = r->in_height;
+  points[2].x = r->in_width;   points[2].y = 0.0f;
+  points[3].x = 0.0f;          points[3].y = 0.0f;
+ }
+ double h[3][3];
+ vec2 aspect;
+ crop_transform(points, h, &aspect);
+ r->out_width  = aspect.x+0.5f > 1 ? aspect.x+0.5f : 1; // (as crop_size)
+ r->out_height = aspect.y+0.5f > 1 ? aspect.y+0.5f : 1;
+ if (!quiet) printf("Saving...\n");
+ int saved = save_warped(p, h, r->out_width, r->out_height, output);
+ free_mip_pyramid(p);
+ return saved > 0 ? FIX_OK : saved < 0 ? FIX_NO_MEMORY : FIX_UNWRITABLE;
+}
 
+// -o: the same, for input_filename, cropped to --crop (or the page, or the whole image).
+int save_headless(const char *filename) {
+ printf("Loading %s...\n", input_filename);
+ double started = now_ms();
+ fix_report r;
+ int result = fix_file(input_filename, filename, crop_given ? start_crop_points : NULL, &r);
+ if (result == FIX_UNREADABLE) printf("Failed.\n");
+ if (result == FIX_NO_MEMORY)  printf("Not enough memory to process the image.\n");
+ if (result != FIX_OK) return 0;
+ printf("Saved to %s\n", filename);
+ printf("Output resolution: %d x %d pixels\n", r.out_width, r.out_height);
+ printf("Done (%.0f ms).\n", now_ms() - started);
+ return 1;
+}
 
+/* --batch: lots of images, without a window, each saved as DIR/<its name>.png (with -2, -3... on the end for the second
+   and later ones with the same name, in the order they're given, so the names don't depend on which finishes first;
+   the first number that no other image has taken).
+   Each of the -t threads takes the next image off the list and does the whole thing for it (fix_file), one image per
+   core: stb_image's decoder and the PNG encoder only use one core each, so this is what keeps all of them busy.
+   The worker pool isn't started, so parallel_for() just runs on the thread that calls it.
+   Memory is what one image takes (see -o), times the number of threads.
+*/
+typedef struct {
+ char *input, *output;
+ vec2 crop[4]; // (crop_points order)
+ int crop_given;
+ int overwrites_input; // (see batch_output_is_input)
+} batch_item;
+batch_item *batch_items;
+int batch_count=0, batch_size=0;
+int batch_next=0, batch_done=0, batch_failed=0;
+pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int add_batch_item(const char *input, const vec2 *crop) {
+ if (batch_count == batch_size) {
+  int size = batch_size ? 2*batch_size : 256;
+  batch_item *items = realloc(batch_items, size * sizeof(batch_item));
+  if (!items) return 0;
+  batch_items = items;
+  batch_size  = size;
+ }
+ batch_item *b = &batch_items[batch_count];
+ memset(b, 0, sizeof(*b));
+ b->input = strdup(input);
+ if (!b->input) return 0;
+ if (crop) { memcpy(b->crop, crop, sizeof(b->crop));  b->crop_given = 1; }
+ batch_count++;
+ return 1;
+}
 
-void textGL(const char *str, float line) {
- glRasterPos2f(-9.f *  strlen(str)   / _viewport_x,
-              -15.f * (line*2.f+1.f) / _viewport_y);
- while (*str) glutBitmapCharacter(GLUT_BITMAP_9_BY_15, *(str++));
+// A file with one image per line, optionally followed by its crop corners, x1,y1,x2,y2,x3,y3,x4,y4 as for --crop.
+// "-" reads the list from stdin. Returns 0 if it can't be read.
+int read_batch_list(const char *filename) {
+ FILE *f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+ if (!f) return 0;
+ char line[4096];
+ int ok = 1;
+ while (ok && fgets(line, sizeof(line), f)) {
+  size_t n = strlen(line);
+  while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r' || line[n-1] == ' ')) line[--n] = 0;
+  if (!n) continue;
+  vec2 c[4];
+  int used = 0;
+  char *space = strrchr(line, ' ');
+  if (space && sscanf(space+1, "%f,%f,%f,%f,%f,%f,%f,%f%n", &c[3].x, &c[3].y, &c[2].x, &c[2].y, &c[1].x, &c[1].y, &c[0].x, &c[0].y, &used) == 8
+      && space[1+used] == 0) {
+   *space = 0;
+   ok = add_batch_item(line, c);
+  }
+  else ok = add_batch_item(line, NULL);
+ }
+ if (f != stdin) fclose(f);
+ return ok;
 }
 
-void flush() {
- glutSwapBuffers();
- glClear(GL_COLOR_BUFFER_BIT);
- glColor3f(1.0f, 1.0f, 1.0f);
+const char *batch_stem(const char *path, int *length) { // the file's name, without the folders or the extension
+ const char *name = strrchr(path, '/');
+ name = name ? name+1 : path;
+ const char *dot = strrchr(name, '.');
+ *length = dot && dot != name ? dot - name : (int)strlen(name);
+ return name;
 }
 
+int compare_batch_names(const void *a, const void *b) { // by name, then by place in the list
+ const batch_item *x = *(batch_item* const*)a, *y = *(batch_item* const*)b;
+ int xn, yn;
+ const char *xs = batch_stem(x->input, &xn), *ys = batch_stem(y->input, &yn);
+ int c = strncmp(xs, ys, xn < yn ? xn : yn);
+ if (!c) c = xn - yn;
+ return c ? c : (x > y) - (x < y);
+}
 
+int batch_name_used(batch_item **sorted, int count, const char *name) { // (a plain search: it's nothing next to loading them)
+ for (int i=0; i<count; i++) if (!strcmp(sorted[i]->output, name)) return 1;
+ return 0;
+}
 
+// An output name that's the same file as one of the images (--batch DIR DIR/a.png) would be written over it,
+// so that image is given no output, and it's reported as failed instead.
+int batch_output_is_input(const char *dir_path, const char *output, char **inputs) {
+ const char *name = strrchr(output, '/') + 1;
+ char path[strlen(dir_path) + strlen(name) + 2];
+ sprintf(path, "%s/%s", dir_path, name);
+ for (int i=0; i<batch_count; i++) if (inputs[i] && !strcmp(inputs[i], path)) return 1;
+ return 0;
+}
 
-void blur_1d(const float *in, float *out, int line_size, int blur_size, int stride) // for horizonal blur, stride should be 1. For vertical blur, stride should be the width of the image.
-{
- if (blur_size > line_size/8) blur_size = line_size/8;
- if (blur_size < 1) blur_size = 1;
- float norm = 0.5f / blur_size;
- float val=0;
- int i;
- for (i=0; i<blur_size; i++) val += in[i*stride];
- for (i=0; i<blur_size; i++) {
-  val += in[(i+blur_size)*stride]; 
-  out[i*stride] = val * norm; // val * norm * 2.0f*(1.0f-i*norm);
+int name_batch_outputs(const char *dir) {
+ batch_item **sorted = malloc(batch_count * sizeof(batch_item*));
+ char **inputs = calloc(batch_count, sizeof(char*)); // where each image really is (NULL if it isn't there)
+ char *dir_path = realpath(dir, NULL);
+ int ok = sorted && inputs && dir_path;
+ for (int i=0; ok && i<batch_count; i++) sorted[i] = &batch_items[i];
+ if (ok) qsort(sorted, batch_count, sizeof(batch_item*), compare_batch_names);
+ for (int i=0; ok && i<batch_count; i++) {
+  inputs[i] = realpath(batch_items[i].input, NULL);
+  if (!inputs[i] && errno == ENOMEM) ok = 0;
  }
- for (   ; i<line_size-blur_size; i++) {
-  val += in[(i+blur_size)*stride];
-  val -= in[(i-blur_size)*stride];
-  out[i*stride] = val * norm;
- }
- for (   ; i<line_size; i++) {
-  val -= in[(i-blur_size)*stride];
-  out[i*stride] = val * norm; // val * norm * 2.0f*(1.0f-(line_size-i)*norm);
+ size_t dir_length = strlen(dir);
+ for (int i=0; ok && i<batch_count; i++) {
+  int n;
+  const char *stem = batch_stem(sorted[i]->input, &n);
+  char *output = malloc(dir_length + n + 32);
+  if (!output) { ok = 0; break; }
+  sprintf(output, "%s/%.*s.png", dir, n, stem);
+  for (int same=2; batch_name_used(sorted, i, output); same++) // (a/a.pgm b/a.pgm c/a-2.pgm: a, a-2, a-2-2)
+   sprintf(output, "%s/%.*s-%d.png", dir, n, stem, same);
+  sorted[i]->output = output;
+  sorted[i]->overwrites_input = batch_output_is_input(dir_path, output, inputs);
  }
+ for (int i=0; inputs && i<batch_count; i++) free(inputs[i]);
+ free(inputs);
+ free(dir_path);
+ free(sorted);
+ return ok;
 }
 
+void *batch_worker(void *arg) {
+ static const char *failures[] = { "", "couldn't load it", "not enough memory", "couldn't write it" };
+ for (;;) {
+  pthread_mutex_lock(&batch_mutex);
+  int i = batch_next++;
+  pthread_mutex_unlock(&batch_mutex);
+  if (i >= batch_count) break;
+  batch_item *b = &batch_items[i];
+  double started = now_ms();
+  fix_report r;
+  int result = b->overwrites_input ? FIX_OK : fix_file(b->input, b->output, b->crop_given ? b->crop : NULL, &r);
+  pthread_mutex_lock(&batch_mutex);
+  batch_done++;
+  if (b->overwrites_input) {
+   batch_failed++;
+   printf("[%d/%d] %s: %s is one of the images, so it wasn't written over\n", batch_done, batch_count, b->input, b->output);
+  }
+  else if (result != FIX_OK) {
+   batch_failed++;
+   printf("[%d/%d] %s: %s\n", batch_done, batch_count, b->input, failures[result]);
+  }
+  else printf("[%d/%d] %s -> %s, %d x %d%s (%.0f ms)\n", batch_done, batch_count, b->input, b->output, r.out_width, r.out_height,
+              b->crop_given ? "" : r.page_found ? ", found the page" : ", the whole image", now_ms() - started);
+  fflush(stdout);
+  pthread_mutex_unlock(&batch_mutex);
+ }
+ return arg;
+}
 
+// Returns how many failed.
+int run_batch(const char *dir, int jobs) {
+ if (mkdir(dir, 0777) && errno != EEXIST) { printf("Couldn't make the folder %s\n", dir); return batch_count; }
+ if (!name_batch_outputs(dir)) { printf("Not enough memory.\n"); return batch_count; }
+ if (jobs > batch_count) jobs = batch_count;
+ printf("%d image%s, %d at a time, into %s\n", batch_count, batch_count == 1 ? "" : "s", jobs, dir);
+ quiet = 1;
+ double started = now_ms();
+ pthread_t threads[jobs];
+ int running = 0;
+ for ( ; running < jobs; running++) if (pthread_create(&threads[running], NULL, batch_worker, NULL)) break;
+ if (!running) batch_worker(NULL); // (no threads: do them all on this one)
+ for (int i=0; i<running; i++) pthread_join(threads[i], NULL);
+ double seconds = (now_ms() - started) / 1000;
+ printf("Done: %d image%s in %.1f s (%.2f per second)", batch_count, batch_count == 1 ? "" : "s", seconds, seconds > 0 ? batch_count / seconds : 0);
+ if (batch_failed) printf(", %d failed", batch_failed);
+ printf(".\n");
+ return batch_failed;
+}
 
+// With --view-size, the graphics card only has the image shrunk, so saving from the window is done this way: on the CPU,
+// at full size, from the moment tables (or the file again, with --stream).
+int save_full_size(const double h[3][3], int width, int height, const char *filename) {
+ mip_pyramid *p = new_mip_pyramid(image_width, image_height);
+ int ok = p != NULL;
+ if (ok && source) ok = stream_normalise(source, local_range, pyramid_row, p);
+ else if (ok && stats) normalise(stats, local_range, p->pixels, 0, image_height);
+ else ok = 0;
+ if (!ok) {
+  printf("Not enough memory to save at full size.\n");
+  free_mip_pyramid(p);
+  return 0;
+ }
+ update_cpu_mipmaps(p);
+ ok = save_warped(p, h, width, height, filename);
+ if (ok < 0) printf("Not enough memory to save at full size.\n");
+ free_mip_pyramid(p);
+ return ok > 0;
+}
 
-
-void init() {
- glEnable(GL_TEXTURE_2D);
- glGenTextures(1, &tex);
- glActiveTexture(GL_TEXTURE0);
- glBindTexture(GL_TEXTURE_2D, tex);
- printf("Loading %s...\n", input_filename);
- textGL("Loading image...",0);  flush();
- int nChannels;
- image_data = stbi_load(input_filename, &image_width, &image_height, &nChannels, 0);
- if (image_data) {
-  printf("Input resolution: %d x %d pixels\n", image_width, image_height);
-  printf("Pre-processing the image");     fflush(stdin);
-  textGL("Pre-processing the image...",0); flush();
-  int size = image_width * image_height;
-  int local_range = 256; // this is the approximate radius (in pixels) for the brightness/contrast auto-adjustments in pre-processing. XXX: Its value shouldn't be hard-coded like this, but where should the user control it instead?
-  
-  // set up 3 temporary buffers which will be needed for pre-processing
-  float *buf1 = malloc(size*sizeof(float)); //
-  float *buf2 = malloc(size*sizeof(float)); // TODO: error checking in case malloc failed
-  float *buf3 = malloc(size*sizeof(float)); //
-
-  // load image data into buf1 (convert to greyscale, 0.0 = middle grey)
-  if (nChannels == 3) {
-   for (int i=0; i<size; i++) buf1[i] = 0.299f*(image_data[i*3]   - 127.5f)
-                                      + 0.587f*(image_data[i*3+1] - 127.5f)
-                                      + 0.114f*(image_data[i*3+2] - 127.5f);
+// Warps the texture the same way on the CPU and compares it with what save_output() saved, and prints how far apart they are.
+void compare_warp(const double h[3][3], int width, int height, const char *filename) {
+ int w, ht, n;
+ unsigned char *saved = stbi_load(filename, &w, &ht, &n, 1);
+ mip_pyramid *p = new_mip_pyramid(image_width, image_height);
+ int band = SAVE_BAND_BYTES / width > 0 ? SAVE_BAND_BYTES / width : 1;
+ unsigned char *rows = malloc((size_t)width * band);
+ if (!saved || !p || !rows || w != width || ht != height) {
+  printf("Can't compare with the CPU.\n");
+  stbi_image_free(saved); free_mip_pyramid(p); free(rows);
+  return;
+ }
+ read_tiled(tex, p->pixels);
+ update_cpu_mipmaps(p);
+ double total = 0;
+ int largest = 0;
+ size_t off = 0; // pixels more than 2 grey levels apart
+ for (int y=0; y<height; y+=band) {
+  int y1 = y+band < height ? y+band : height;
+  warp_image(p, h, width, height, y, y1, rows);
+  for (size_t i=0; i<(size_t)width*(y1-y); i++) {
+   int d = abs(rows[i] - saved[(size_t)y*width + i]);
+   total += d;
+   if (d > largest) largest = d;
+   if (d > 2) off++;
   }
-  else {
-   for (int i=0; i<size; i++) buf1[i] = image_data[i*nChannels] - 127.5f;
-  }
-  // and we don't need the original image data anymore
-  stbi_image_free(image_data);
- 
-  // buf2 := horizontally blurred buf1
-  for (int i=0; i<size; i+=image_width) blur_1d(&buf1[i], &buf2[i], image_width, local_range, 1);
-  putchar('.'); fflush(stdout);
-  
-  // buf3 := vertically blurred buf2
-  // buf3 becomes a "local average brightness" map.
-  for (int i=0; i<image_width; i++) blur_1d(&buf2[i], &buf3[i], image_height, local_range, image_width);
-  putchar('.'); fflush(stdout);
-  
-  // buf1 -= buf3
-  // buf1 becomes a "brightness-corrected image". RGB values have a local average of 0.
-  for (int i=0; i<size; i++) buf1[i] = buf1[i] - buf3[i];
-  putchar('.'); fflush(stdout);
-  
-  // buf2 := buf1 values squared
-  for (int i=0; i<size; i++) buf2[i] = buf1[i] * buf1[i];
-  putchar('.'); fflush(stdout);
-  
-  // buf3 := horizontally blurred buf2
-  for (int i=0; i<size; i+=image_width) blur_1d(&buf2[i], &buf3[i], image_width, local_range, 1);
-  putchar('.'); fflush(stdout);
-  
-  // buf2 := vertically blurred buf3
-  for (int i=0; i<image_width; i++) blur_1d(&buf3[i], &buf2[i], image_height, local_range, image_width);
-  putchar('.'); fflush(stdout);
-  
-  // buf2 := inverse square root buf2
-  // buf2 becomes a "reciprocal of the local standard deviation" map.
-  for (int i=0; i<size; i++) buf2[i] = 1.0f / sqrtf(buf2[i]);
-  putchar('.'); fflush(stdout);
-  
-  // buf1 *= buf2
-  // buf1 becomes a "contrast-normalized image". RGB values have a local standard deviation of 1.
-  for (int i=0; i<size; i++) buf1[i] *= buf2[i];
-  putchar('.'); fflush(stdout);
-
-  // buf1: tweak the contrast a bit more, and shift everything by 1 so an 'average' pixel will appear white
-  for (int i=0; i<size; i++) buf1[i] = buf1[i] * 0.5f + 1.0f;
-  putchar('.'); fflush(stdout);
-
-  // send buf1 to the graphics card, as a texture
-  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, image_width, image_height, 0, GL_RED, GL_FLOAT, buf1); // XXX: how to handle the case where dimensions exceed GL_MAX_TEXTURE_SIZE?
+ }
+ size_t pixels = (size_t)width * height;
+ printf("GPU vs CPU warp: mean difference %.2f grey levels, largest %d, %zu pixels more than 2 apart (%.4f%%) - %s\n",
+        total / pixels, largest, off, 100.0 * off / pixels, off <= pixels/100 ? "OK" : "MISMATCH");
+ stbi_image_free(saved);
+ free_mip_pyramid(p);
+ free(rows);
+}
 
-  // we don't need the temporary buffers anymore
-  free(buf1);
-  free(buf2);
-  free(buf3);
-  
-  // more OpenGL stuff
-  glGenerateMipmap(GL_TEXTURE_2D);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+/* The loupe (Z): the image around the mouse, magnified, for placing the corners exactly.
+   It shows the full-size image even when tex is shrunk (--view-size), through a virtual texture: the image is cut into
+   VT_TILE x VT_TILE tiles, which are normalised on the CPU from the moment tables when the loupe first needs them, and
+   kept in a pool of VT_POOL small textures, the least recently drawn going first. So they take the same graphics memory
+   whatever the size of the image. Tiles are made in a timer between frames, a few ms' worth at a time, and go up
+   through a pixel buffer object, so the driver copies them while the next one is made; until a tile is in, the loupe
+   shows tex there. The loupe only ever magnifies, so only full-size tiles are needed: the mipmapped tex does the rest.
+   (With --stream or --gpu there are no moment tables to make tiles from, so it's all tex.)
+*/
+#define VT_TILE    256 // texels a tile has of its own, plus 1 all round from its neighbours, for the filtering
+#define VT_POOL    64  // tiles on the graphics card (64 x 258 x 258 half floats: about 8 MB)
+#define VT_FILL_MS 4   // how long to spend making tiles between frames
+typedef struct {
+ int x, y;           // which tile (column, row), or x = -1 if the slot's empty
+ int range;          // the local_range it was made for
+ unsigned last_used; // vt_frame when it was last drawn
+ GLuint texture;
+} vt_slot;
+vt_slot vt_pool[VT_POOL];
+GLuint vt_buffer = 0; // (0 = the pool isn't set up)
+float *vt_floats;     // a tile, before it's made into half floats
+unsigned vt_frame = 0;
+int vt_wanted[VT_POOL][2], vt_wanted_count = 0; // tiles the loupe needs, nearest the middle first
+int vt_filling = 0;   // a vt_fill is on the timer
+
+int show_loupe = 0;
+int loupe_zoom = 4;   // screen pixels per image pixel
+int mouse_x = -1, mouse_y = -1;
+
+int init_vt() { // the pool, the first time it's needed; 0 if it can't be
+ if (vt_buffer) return 1;
+ vt_floats = malloc((VT_TILE+2) * (VT_TILE+2) * sizeof(float));
+ if (!vt_floats) return 0;
+ for (int i=0; i<VT_POOL; i++) {
+  vt_pool[i].x = -1;
+  glGenTextures(1, &vt_pool[i].texture);
+  glBindTexture(GL_TEXTURE_2D, vt_pool[i].texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, VT_TILE+2, VT_TILE+2, 0, GL_RED, GL_FLOAT, NULL); // (like tex, >1 is kept)
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_RED);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
-  glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
-  reset_crop_points();
-  recalc_crop_aspect();
-  printf("\nDone.\n");
  }
- else printf("Failed.\n");
+ glGenBuffers(1, &vt_buffer);
+ return 1;
 }
 
+void free_vt() {
+ if (!vt_buffer) return;
+ for (int i=0; i<VT_POOL; i++) glDeleteTextures(1, &vt_pool[i].texture);
+ glDeleteBuffers(1, &vt_buffer);
+ free(vt_floats);
+ vt_buffer = 0;
+}
 
+vt_slot *find_tile(int x, int y) { // NULL if it isn't in the pool (or is for another radius)
+ for (int i=0; i<VT_POOL; i++)
+  if (vt_pool[i].x == x && vt_pool[i].y == y && vt_pool[i].range == local_range) return &vt_pool[i];
+ return NULL;
+}
 
+int make_tile(int x, int y) { // into the least recently drawn slot; 0 if there isn't one free
+ vt_slot *slot = NULL;
+ for (int i=0; i<VT_POOL; i++) {
+  vt_slot *s = &vt_pool[i];
+  if (s->x >= 0 && s->last_used == vt_frame) continue; // (the loupe's drawing it now)
+  if (!slot || s->x < 0 || (slot->x >= 0 && s->last_used < slot->last_used)) slot = s;
+ }
+ if (!slot) return 0; // (the loupe needs more tiles than the pool has: the rest stay tex)
+ int size = VT_TILE+2;
+ normalise_rect(stats, local_range, vt_floats, x*VT_TILE-1, y*VT_TILE-1, size, size);
+ glBindBuffer(GL_PIXEL_UNPACK_BUFFER, vt_buffer);
+ glBufferData(GL_PIXEL_UNPACK_BUFFER, size*size * sizeof(half), NULL, GL_STREAM_DRAW); // (a fresh buffer: no waiting for the last upload)
+ half *px = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+ if (px) {
+  to_half(px, vt_floats, size*size);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glBindTexture(GL_TEXTURE_2D, slot->texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RED, GL_HALF_FLOAT, 0); // (from the buffer)
+  slot->x = x;
+  slot->y = y;
+  slot->range = local_range;
+  slot->last_used = vt_frame;
+ }
+ glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+ return px != NULL;
+}
 
+void vt_fill(int value) { // makes the tiles the loupe asked for, for up to VT_FILL_MS
+ vt_filling = 0;
+ if (!stats || loading) return;
+ double started = now_ms();
+ int made = 0;
+ for (int i=0; i<vt_wanted_count && now_ms() - started < VT_FILL_MS; i++)
+  if (!find_tile(vt_wanted[i][0], vt_wanted[i][1])) made += make_tile(vt_wanted[i][0], vt_wanted[i][1]);
+ vt_wanted_count = 0;
+ if (made) glutPostRedisplay(); // (the loupe asks again for any that are still missing)
+}
 
-void draw()
-{
- if (!image_data) {
-  textGL("Input file doesn't exist, or is not an image.",0);  flush();
-  return;
- }
- if (finished_everything) {
-  textGL("Saved to file:",               -1);
-  textGL(output_filename ,                0);
-  textGL("You can close this window now.",2);
-  flush();
-  return;
+// Where the loupe is, in the window and in the image: on the mouse, or on the corner being dragged.
+void loupe_centre(vec2 *window, vec2 *image) {
+ window->x = mouse_x;  window->y = mouse_y;
+ *image = wpc2ipc(*window);
+ if (selected_crop_point >= 0) {
+  *image = crop_points[selected_crop_point];
+  *window = ipc2wpc(*image);
  }
+}
 
- vec2 a = ipc2txc(crop_points[0]);
- vec2 b = ipc2txc(crop_points[1]);
- vec2 c = ipc2txc(crop_points[2]);
- vec2 d = ipc2txc(crop_points[3]);
- // The crop area is a quadrilateral shape defined by the 4 points a,b,c,d.
- // We have to interperet this shape as being a rectangle in perspective.
- // So first we calculate the "vanishing points":
- // let p be the intersection point of the 2 lines defined by (a,b) and (c,d)
- // let q be the intersection point of the 2 lines defined by (a,d) and (c,b)
- // There's a long formula for these points, and it's a fraction.
- // We calculate the denominators first, so we can handle special cases where the denominator is 0 (parallel lines).
- vec2 p,q;
- p.x = a.x*c.y - a.x*d.y - b.x*c.y + b.x*d.y - c.x*a.y + c.x*b.y + d.x*a.y - d.x*b.y;
- p.y = a.y*c.x - a.y*d.x - b.y*c.x + b.y*d.x - c.y*a.x + c.y*b.x + d.y*a.x - d.y*b.x;
- q.x = a.x*c.y - a.x*b.y - d.x*c.y + d.x*b.y - c.x*a.y + c.x*d.y + b.x*a.y - b.x*d.y;
- q.y = a.y*c.x - a.y*b.x - d.y*c.x + d.y*b.x - c.y*a.x + c.y*d.x + b.y*a.x - b.y*d.x;
- float aFactor, bFactor, cFactor, dFactor; // These factors will tell OpenGL how to interpolate texture coordinates in proper perspective.
- if (isFloatNonzeroEnough(p.x) && isFloatNonzeroEnough(p.y)) {
-  if (isFloatNonzeroEnough(q.x) && isFloatNonzeroEnough(q.y)) {
-   // The crop area has no parallel lines.
-   // So we finish calculating the vanishing points:
-   p.x = (a.x*c.x*b.y - a.x*c.x*d.y - a.x*d.x*b.y + a.x*d.x*c.y - b.x*c.x*a.y + b.x*c.x*d.y + b.x*d.x*a.y - b.x*d.x*c.y) / p.x;
-   p.y = (a.y*c.y*b.x - a.y*c.y*d.x - a.y*d.y*b.x + a.y*d.y*c.x - b.y*c.y*a.x + b.y*c.y*d.x + b.y*d.y*a.x - b.y*d.y*c.x) / p.y;
-   q.x = (a.x*c.x*d.y - a.x*c.x*b.y - a.x*b.x*d.y + a.x*b.x*c.y - d.x*c.x*a.y + d.x*c.x*b.y + d.x*b.x*a.y - d.x*b.x*c.y) / q.x;
-   q.y = (a.y*c.y*d.x - a.y*c.y*b.x - a.y*b.y*d.x + a.y*b.y*c.x - d.y*c.y*a.x + d.y*c.y*b.x + d.y*b.y*a.x - d.y*b.y*c.x) / q.y;
-   // Next, consider the "horizon" line which runs between the two vanishing points.
-   // Then for each point a,b,c,d, we calculate its distance from the horizon.
-   // The reciprocal of that, will be the 'factor' we give to OpenGL.
-   aFactor = 1.0f/(q.x*a.y + a.x*p.y + p.x*q.y - q.x*p.y - p.x*a.y - a.x*q.y);
-   bFactor = 1.0f/(q.x*b.y + b.x*p.y + p.x*q.y - q.x*p.y - p.x*b.y - b.x*q.y);
-   cFactor = 1.0f/(q.x*c.y + c.x*p.y + p.x*q.y - q.x*p.y - p.x*c.y - c.x*q.y);
-   dFactor = 1.0f/(q.x*d.y + d.x*p.y + p.x*q.y - q.x*p.y - p.x*d.y - d.x*q.y);
-  }
-  else {
-   // The crop area is a trapezoid:
-   // lines AD and CB are parallel.
-   if (fabs(a.x-d.x) > fabs(a.y-d.y)) {
-    aFactor = dFactor = 1.0f / (a.x - d.x);
-    cFactor = bFactor = 1.0f / (b.x - c.x);
-   } else {
-    aFactor = dFactor = 1.0f / (a.y - d.y);
-    cFactor = bFactor = 1.0f / (b.y - c.y);
+int loupe_shown() {
+ vec2 window, image;
+ loupe_centre(&window, &image);
+ return show_loupe && mouse_x >= 0 && !finished_everything
+     && window.x >= 0 && window.x < _viewport_x/2 && window.y >= 0 && window.y < _viewport_y;
+}
+
+void draw_loupe() {
+ vt_frame++;
+ glColor3f(1.0f, 1.0f, 1.0f);
+ int side = (_viewport_x/2 < _viewport_y ? _viewport_x/2 : _viewport_y) / 2; // in screen pixels
+ float half_side = 0.5f * side / loupe_zoom; // ... and in image pixels
+ vec2 centre, middle;
+ loupe_centre(&centre, &middle);
+ vec2 lo, hi; // the loupe, in NDC (lo: bottom left)
+ lo.x = ( 2.0f*(centre.x - 0.5f*side)) / _viewport_x - 1.0f;  hi.x = lo.x + 2.0f*side / _viewport_x;
+ lo.y = (-2.0f*(centre.y + 0.5f*side)) / _viewport_y + 1.0f;  hi.y = lo.y + 2.0f*side / _viewport_y;
+ float to_ndc_x = (hi.x-lo.x) / (2*half_side), to_ndc_y = (hi.y-lo.y) / (2*half_side); // per image pixel
+
+ // tex underneath (it's what shows where the tiles aren't in yet)
+ vec2 shown[4];
+ shown[0].x = middle.x - half_side;  shown[0].y = middle.y + half_side;
+ shown[1].x = middle.x + half_side;  shown[1].y = middle.y + half_side;
+ shown[2].x = middle.x + half_side;  shown[2].y = middle.y - half_side;
+ shown[3].x = middle.x - half_side;  shown[3].y = middle.y - half_side;
+ double h[3][3];
+ quad_homography(shown, h);
+ draw_tiled(tex, h, lo.x, lo.y, hi.x, hi.y);
+
+ // the tiles that are in, and a list of the ones that aren't
+ if (stats && !loading && init_vt()) {
+  int tx0 = floorf(shown[0].x / VT_TILE), tx1 = floorf(shown[1].x / VT_TILE);
+  int ty0 = floorf(shown[2].y / VT_TILE), ty1 = floorf(shown[1].y / VT_TILE);
+  int last_x = (image_width-1) / VT_TILE, last_y = (image_height-1) / VT_TILE;
+  tx0 = tx0 > 0 ? tx0 : 0;  tx1 = tx1 < last_x ? tx1 : last_x;
+  ty0 = ty0 > 0 ? ty0 : 0;  ty1 = ty1 < last_y ? ty1 : last_y;
+  vt_wanted_count = 0;
+  glEnable(GL_TEXTURE_2D);
+  for (int ty=ty0; ty<=ty1; ty++) for (int tx=tx0; tx<=tx1; tx++) {
+   vt_slot *slot = find_tile(tx, ty);
+   if (!slot) {
+    if (vt_wanted_count == VT_POOL) continue;
+    float dx = (tx+0.5f)*VT_TILE - middle.x, dy = (ty+0.5f)*VT_TILE - middle.y;
+    int i = vt_wanted_count++;
+    for ( ; i > 0; i--) { // (in order of distance from the middle)
+     float ex = (vt_wanted[i-1][0]+0.5f)*VT_TILE - middle.x, ey = (vt_wanted[i-1][1]+0.5f)*VT_TILE - middle.y;
+     if (ex*ex + ey*ey <= dx*dx + dy*dy) break;
+     vt_wanted[i][0] = vt_wanted[i-1][0];  vt_wanted[i][1] = vt_wanted[i-1][1];
+    }
+    vt_wanted[i][0] = tx;  vt_wanted[i][1] = ty;
+    continue;
    }
+   slot->last_used = vt_frame;
+   // the part of the tile in the loupe, in image pixels
+   float x0 = tx*VT_TILE > shown[0].x ? tx*VT_TILE : shown[0].x, x1 = (tx+1)*VT_TILE < shown[1].x ? (tx+1)*VT_TILE : shown[1].x;
+   float y0 = ty*VT_TILE > shown[2].y ? ty*VT_TILE : shown[2].y, y1 = (ty+1)*VT_TILE < shown[1].y ? (ty+1)*VT_TILE : shown[1].y;
+   if (x1 > image_width)  x1 = image_width;
+   if (y1 > image_height) y1 = image_height;
+   float s0 = (x0 - tx*VT_TILE + 1) / (VT_TILE+2), s1 = (x1 - tx*VT_TILE + 1) / (VT_TILE+2);
+   float t0 = (y0 - ty*VT_TILE + 1) / (VT_TILE+2), t1 = (y1 - ty*VT_TILE + 1) / (VT_TILE+2);
+   float nx0 = lo.x + (x0 - shown[0].x) * to_ndc_x, nx1 = lo.x + (x1 - shown[0].x) * to_ndc_x;
+   float ny0 = hi.y - (y0 - shown[2].y) * to_ndc_y, ny1 = hi.y - (y1 - shown[2].y) * to_ndc_y; // (image y goes down)
+   glBindTexture(GL_TEXTURE_2D, slot->texture);
+   glBegin(GL_QUADS);
+   glTexCoord2f(s0, t0); glVertex2f(nx0, ny0);
+   glTexCoord2f(s1, t0); glVertex2f(nx1, ny0);
+   glTexCoord2f(s1, t1); glVertex2f(nx1, ny1);
+   glTexCoord2f(s0, t1); glVertex2f(nx0, ny1);
+   glEnd();
   }
- }
- else if (isFloatNonzeroEnough(q.x) && isFloatNonzeroEnough(q.y)) {
-  // The crop area is a trapezoid:
-  // lines AB and CD are parallel.
-  if (fabs(a.x-b.x) > fabs(a.y-b.y)) {
-   aFactor = bFactor = 1.0f / (a.x - b.x);
-   cFactor = dFactor = 1.0f / (d.x - c.x);
-  } else {
-   aFactor = bFactor = 1.0f / (a.y - b.y);
-   cFactor = dFactor = 1.0f / (d.y - c.y);
+  glDisable(GL_TEXTURE_2D);
+  if (vt_wanted_count && !vt_filling) {
+   vt_filling = 1;
+   glutTimerFunc(0, vt_fill, 0);
   }
  }
- else {
-  // The crop area is a parallellogram, possibly a rectangle.
-  // So there's no perspective interpolation - we set all the 'factors' to 1.
-  aFactor = bFactor = cFactor = dFactor = 1.0f;
- }
 
+ // the crop, magnified too, and a frame
+ glEnable(GL_SCISSOR_TEST);
+ glScissor(centre.x - side/2, _viewport_y - centre.y - side/2, side, side);
+ glLineWidth(1.0f);
+ glColor3f(0.0f, 1.0f, 0.0f);
+ glBegin(GL_LINE_LOOP);
+ for (int k=0; k<4; k++)
+  glVertex2f(lo.x + (crop_points[k].x - shown[0].x) * to_ndc_x, hi.y - (crop_points[k].y - shown[2].y) * to_ndc_y);
+ glEnd();
+ glDisable(GL_SCISSOR_TEST);
+ glColor3f(0.5f, 0.5f, 0.5f);
+ glBegin(GL_LINE_LOOP);
+ glVertex2f(lo.x, lo.y);  glVertex2f(hi.x, lo.y);  glVertex2f(hi.x, hi.y);  glVertex2f(lo.x, hi.y);
+ glEnd();
+}
 
- if (save_and_quit)
- {
-  printf("Saving...\n");
-  textGL("Saving...",0); flush();
-  
-  GLint width = crop_aspect.x+0.5f;
-  GLint height = crop_aspect.y+0.5f; // XXX: how to handle the case where dimensions exceed GL_MAX_VIEWPORT_DIMS?
-  GLuint fb; // frame buffer
-  GLuint rb; // render buffer
-
-  // set up an offscreen buffer, and use it
-  glGenFramebuffersEXT(1, &fb);
-  glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fb);
-  glGenRenderbuffersEXT(1, &rb);
-  glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, rb);
-  glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, width, height);
-  glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, rb);
-  GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
-  if (status != GL_FRAMEBUFFER_COMPLETE_EXT) { /* fail */ }
-  glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fb);
-  glViewport(0, 0, width, height);
-
-  // render the frame
-  glEnable(GL_TEXTURE_2D);
-  glBegin(GL_QUADS);
-  glTexCoord4f(d.x*dFactor, d.y*dFactor, 0.0f, dFactor);
-  glVertex2f(-1.0f, -1.0f);
-  glTexCoord4f(c.x*cFactor, c.y*cFactor, 0.0f, cFactor);
-  glVertex2f( 1.0f, -1.0f);
-  glTexCoord4f(b.x*bFactor, b.y*bFactor, 0.0f, bFactor);
-  glVertex2f( 1.0f,  1.0f);
-  glTexCoord4f(a.x*aFactor, a.y*aFactor, 0.0f, aFactor);
-  glVertex2f(-1.0f,  1.0f);
-  glEnd();
-  glDisable(GL_TEXTURE_2D);
 
-  // capture the pixels that were rendered
-  unsigned char *data = malloc(width * height);
-  if (!data) { /* TODO: handle error */ }
-  glPixelStorei(GL_PACK_ALIGNMENT, 1);
-  glReadPixels(0,0, width, height, GL_RED, GL_UNSIGNED_BYTE, data);
+// --frame-times: prints how long draw() takes, on average and at worst, every 60 frames. It waits for the graphics card
+// to finish each frame, so that's counted too (and so it's a little slower).
+// --hud (or H): shows the last frame's time on screen, and how long since the input it shows arrived.
+int show_frame_times=0, show_hud=0;
+double input_ms=0;                          // when the oldest input not yet on screen arrived (0 = none)
+double last_frame_ms=0, last_latency_ms=0;  // for the HUD
+void frame_done(double started) {
+ static int frames = 0, inputs = 0;
+ static double total = 0, worst = 0, latency = 0;
+ glFinish();
+ double t = now_ms() - started;
+ last_frame_ms = t;
+ if (input_ms) {
+  last_latency_ms = now_ms() - input_ms;
+  latency += last_latency_ms;
+  inputs++;
+  input_ms = 0;
+ }
+ total += t;
+ if (t > worst) worst = t;
+ if (!show_frame_times || ++frames < 60) return;
+ printf("Frame time: %.2f ms average, %.2f ms worst (%s, %d x %d)", total / frames, worst,
+        use_shaders ? "shaders" : "fixed function", _viewport_x, _viewport_y);
+ if (inputs) printf(", input to screen %.1f ms average", latency / inputs);
+ printf("\n");
+ frames = inputs = 0;
+ total = worst = latency = 0;
+}
 
-  // delete the offscreen buffer, reset openGL to using the default buffers
-  glDeleteRenderbuffersEXT(1, &rb);
-  glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0); // unbind
-  glDeleteFramebuffersEXT(1, &fb);
-  glViewport(0, 0, (GLint)_viewport_x, (GLint)_viewport_y);
-  glClear(GL_COLOR_BUFFER_BIT);
+void draw_hud() {
+ char line[80];
+ snprintf(line, sizeof(line), "Frame %.1f ms, input to screen %.1f ms", last_frame_ms, last_latency_ms);
+ glColor3f(1.0f, 0.5f, 0.0f);
+ glRasterPos2f(-1.0f + 8.0f/_viewport_x, 1.0f - 30.0f/_viewport_y);
+ for (const char *c = line; *c; c++) glutBitmapCharacter(GLUT_BITMAP_9_BY_15, *c);
+}
 
-  // write the captured pixels to a file
-  update_output_filename();
-  stbi_write_png(output_filename, width, height, 1, data, width);
+/* The panes, as last drawn (without the crop lines), in a texture the size of the window. The left pane only changes
+   with the image, so while the crop moves only the right pane is drawn again, and a frame where neither changed is just
+   a copy. --no-pane-cache draws both every frame.
+*/
+int use_pane_cache=1;
+GLuint pane_framebuffer=0, pane_texture=0;
+int pane_width=0, pane_height=0;
+int pane_changes=-1;        // texture_changes when the panes were drawn (-1 = they weren't, or the image was loading)
+double pane_crop_h[3][3];   // the crop the right pane was drawn with
+
+void free_pane_cache() {
+ if (pane_framebuffer) glDeleteFramebuffersEXT(1, &pane_framebuffer);
+ if (pane_texture) glDeleteTextures(1, &pane_texture);
+ pane_framebuffer = pane_texture = 0;
+ pane_width = pane_height = 0;
+ pane_changes = -1;
+}
 
-  free(data);
-  printf("Saved to %s\n", output_filename);
-  printf("Output resolution: %d x %d pixels\n", width, height);
-  finished_everything = 1;
-  draw();
-  return;
+int pane_cache_ready() { // (re)makes it at the window's size; 0 if it can't be used
+ if (!use_pane_cache || _viewport_x <= 0 || _viewport_y <= 0) return 0;
+ if (pane_width == _viewport_x && pane_height == _viewport_y) return 1;
+ free_pane_cache();
+ glGenTextures(1, &pane_texture);
+ glBindTexture(GL_TEXTURE_2D, pane_texture);
+ glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, _viewport_x, _viewport_y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+ glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+ glGenFramebuffersEXT(1, &pane_framebuffer);
+ glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pane_framebuffer);
+ glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, pane_texture, 0);
+ GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+ glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+ if (status != GL_FRAMEBUFFER_COMPLETE_EXT) {
+  printf("Can't keep the panes in a texture; drawing them every frame.\n");
+  free_pane_cache();
+  use_pane_cache = 0;
+  return 0;
  }
+ pane_width  = _viewport_x;
+ pane_height = _viewport_y;
+ return 1;
+}
 
-
+// The uncropped image, centred in the left half of the window.
+void draw_left_pane() {
  float inv_vx = 1.0f / _viewport_x;
  float inv_vy = 1.0f / _viewport_y;
- glClear(GL_COLOR_BUFFER_BIT);
-
- // left pane
  vec2 aspect; aspect.x = image_width * inv_vx*2.0f;
               aspect.y = image_height * inv_vy;
+ vec2 shown[4]; // the image pixels at the pane's corners (the image is centred, and fits the pane one way or the other)
  if (aspect.x > aspect.y) {
   float ratio = aspect.x / aspect.y;
-  glEnable(GL_TEXTURE_2D);
-  glBegin(GL_QUADS);
-  glTexCoord2f(0.0f, 0.5f+0.5f*ratio);
-  glVertex2f(-1.0f, -1.0f);
-  glTexCoord2f(1.0f, 0.5f+0.5f*ratio);
-  glVertex2f( 0.0f, -1.0f);
-  glTexCoord2f(1.0f, 0.5f-0.5f*ratio);
-  glVertex2f( 0.0f,  1.0f);
-  glTexCoord2f(0.0f, 0.5f-0.5f*ratio);
-  glVertex2f(-1.0f,  1.0f);
-  glEnd();
+  shown[0].x = 0.0f;         shown[0].y = (0.5f+0.5f*ratio) * image_height;
+  shown[2].x = image_width;  shown[2].y = (0.5f-0.5f*ratio) * image_height;
  }
  else {
   float ratio = 0.5f * aspect.y / aspect.x;
-  glEnable(GL_TEXTURE_2D);
-  glBegin(GL_QUADS);
-  glTexCoord2f(0.5f-ratio, 1.0f);
-  glVertex2f(-1.0f, -1.0f);
-  glTexCoord2f(0.5f+ratio, 1.0f);
-  glVertex2f( 0.0f, -1.0f);
-  glTexCoord2f(0.5f+ratio, 0.0f);
-  glVertex2f( 0.0f,  1.0f);
-  glTexCoord2f(0.5f-ratio, 0.0f);
-  glVertex2f(-1.0f,  1.0f);
-  glEnd();
+  shown[0].x = (0.5f-ratio) * image_width;  shown[0].y = image_height;
+  shown[2].x = (0.5f+ratio) * image_width;  shown[2].y = 0.0f;
  }
+ shown[1].x = shown[2].x;  shown[1].y = shown[0].y;
+ shown[3].x = shown[0].x;  shown[3].y = shown[2].y;
+ double h_left[3][3];
+ quad_homography(shown, h_left);
+ draw_tiled(tex, h_left, -1.0f, -1.0f, 0.0f, 1.0f);
+}
 
- // right pane 
- aspect = crop_aspect;
+// The cropped image, as it'll be saved, centred in the right half.
+void draw_right_pane() {
+ float inv_vx = 1.0f / _viewport_x;
+ float inv_vy = 1.0f / _viewport_y;
+ vec2 aspect = crop_aspect;
  aspect.x *= inv_vx*2.0f;
  aspect.y *= inv_vy;
  if (aspect.x > aspect.y) {
   float ratio = aspect.y / aspect.x;
-  glBegin(GL_QUADS);
-  glTexCoord4f(a.x*aFactor, a.y*aFactor, 0.0f, aFactor);
-  glVertex2f(0.0f, -ratio);
-  glTexCoord4f(b.x*bFactor, b.y*bFactor, 0.0f, bFactor);
-  glVertex2f(1.0f, -ratio);
-  glTexCoord4f(c.x*cFactor, c.y*cFactor, 0.0f, cFactor);
-  glVertex2f(1.0f,  ratio);
-  glTexCoord4f(d.x*dFactor, d.y*dFactor, 0.0f, dFactor);
-  glVertex2f(0.0f,  ratio);
-  glEnd();
+  draw_tiled(tex, crop_h, 0.0f, ratio, 1.0f, -ratio); // (NDC are upside down)
  }
  else {
   float ratio = 0.5f * aspect.x / aspect.y;
-  glBegin(GL_QUADS);
-  glTexCoord4f(a.x*aFactor, a.y*aFactor, 0.0f, aFactor);
-  glVertex2f(0.5f-ratio, -1.0f);
-  glTexCoord4f(b.x*bFactor, b.y*bFactor, 0.0f, bFactor);
-  glVertex2f(0.5f+ratio, -1.0f);
-  glTexCoord4f(c.x*cFactor, c.y*cFactor, 0.0f, cFactor);
-  glVertex2f(0.5f+ratio,  1.0f);
-  glTexCoord4f(d.x*dFactor, d.y*dFactor, 0.0f, dFactor);
-  glVertex2f(0.5f-ratio,  1.0f);
-  glEnd();
+  draw_tiled(tex, crop_h, 0.5f-ratio, 1.0f, 0.5f+ratio, -1.0f);
+ }
+}
+
+void draw()
+{
+ double started = now_ms();
+ if (!image_data && !loading) {
+  textGL("Input file doesn't exist, or is not an image.",0);  flush();
+  return;
+ }
+ if (finished_everything) {
+  textGL("Saved to file:",               -1);
+  textGL(output_filename ,                0);
+  textGL("You can close this window now.",2);
+  flush();
+  return;
+ }
+
+ if (save_and_quit && !loading) // (otherwise it saves once the full image is ready)
+ {
+  printf("Saving...\n");
+  textGL("Saving...",0); flush();
+  
+  int width, height;
+  crop_size(&width, &height);
+  update_output_filename();
+  int cpu = view_shrink() > 1;
+  int ok = cpu ? save_full_size(crop_h, width, height, output_filename)
+               : save_output(crop_h, width, height, output_filename); // (the top row first, which glReadPixels gives as the bottom)
+  glViewport(0, 0, (GLint)_viewport_x, (GLint)_viewport_y);
+  glClear(GL_COLOR_BUFFER_BIT);
+  if (!ok) {
+   save_and_quit = 0;
+   glutPostRedisplay();
+   return;
+  }
+  printf("Saved to %s\n", output_filename);
+  printf("Output resolution: %d x %d pixels\n", width, height);
+  if (check_warp && !cpu) compare_warp(crop_h, width, height, output_filename);
+  finished_everything = 1;
+  draw();
+  return;
+ }
+
+
+ int cached = pane_cache_ready();
+ int left  = !cached || loading || pane_changes != texture_changes;
+ int right = left || memcmp(pane_crop_h, crop_h, sizeof(crop_h));
+ if (cached) glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pane_framebuffer);
+ glEnable(GL_SCISSOR_TEST); // (for the clears)
+ if (left) {
+  glScissor(0, 0, _viewport_x/2, _viewport_y);
+  glClear(GL_COLOR_BUFFER_BIT);
+  draw_left_pane();
+ }
+ if (right) {
+  glScissor(_viewport_x/2, 0, _viewport_x - _viewport_x/2, _viewport_y);
+  glClear(GL_COLOR_BUFFER_BIT);
+  draw_right_pane();
+ }
+ glDisable(GL_SCISSOR_TEST);
+ if (cached) { // copy them to the window
+  pane_changes = loading ? -1 : texture_changes;
+  memcpy(pane_crop_h, crop_h, sizeof(crop_h));
+  glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, pane_framebuffer);
+  glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER_EXT, 0);
+  glBlitFramebufferEXT(0, 0, _viewport_x, _viewport_y, 0, 0, _viewport_x, _viewport_y, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
  }
 
  // cropping indicator
- glDisable(GL_TEXTURE_2D);
- a = wpc2ndc(ipc2wpc(crop_points[0]));
- b = wpc2ndc(ipc2wpc(crop_points[1]));
- c = wpc2ndc(ipc2wpc(crop_points[2]));
- d = wpc2ndc(ipc2wpc(crop_points[3]));
+ vec2 a = wpc2ndc(ipc2wpc(crop_points[0]));
+ vec2 b = wpc2ndc(ipc2wpc(crop_points[1]));
+ vec2 c = wpc2ndc(ipc2wpc(crop_points[2]));
+ vec2 d = wpc2ndc(ipc2wpc(crop_points[3]));
  glColor3f(0.0f, 0.4f, 0.0f);
  glRasterPos2f(a.x-20.f/_viewport_x, a.y-13.f/_viewport_y); glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '4');
  glRasterPos2f(b.x +4.f/_viewport_x, b.y-13.f/_viewport_y); glutBitmapCharacter(GLUT_BITMAP_8_BY_13, '3');
@@ -503,15 +3037,31 @@ void draw()
  glVertex2f(d.x, d.y);
  glEnd();
 
+ if (loupe_shown()) draw_loupe();
+
+ if (loading) {
+  glColor3f(0.0f, 0.4f, 0.0f);
+  textGL(save_and_quit ? "Pre-processing the image... (will save when it's done)" : "Pre-processing the image...", 0);
+ }
+
+ if (show_hud) draw_hud();
+
  // ready
  flush();
+ if (show_frame_times || show_hud) frame_done(started);
 }
 
 
 
 
 void done() {
- glDeleteTextures(1, &tex);
+ if (loading) return; // (the loader thread may still be using its memory)
+ free_pane_cache();
+ free_vt();
+ free_tiled_texture(tex);
+ free_moments(stats);
+ free_gpu_tables(gpu_stats);
+ close_source(source);
 }
 
 
@@ -522,6 +3072,50 @@ void done() {
 
 
 
+/* Input only changes the state, and asks for a redraw: GLUT calls draw() once the events waiting have been handled,
+   so a burst of mouse motion costs one frame, and with vsync on, at most one per refresh of the screen.
+*/
+void redraw_for_input() {
+ if (!input_ms) input_ms = now_ms();
+ glutPostRedisplay();
+}
+
+// Has glutSwapBuffers wait for the screen's refresh, if the driver lets programs choose.
+void set_vsync() {
+ Display *display = glXGetCurrentDisplay();
+ const char *extensions = display ? glXQueryExtensionsString(display, DefaultScreen(display)) : NULL;
+ if (!extensions) return;
+ int (*swap_interval)(unsigned) = NULL;
+ if      (strstr(extensions, "GLX_MESA_swap_control")) swap_interval = (void*)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalMESA");
+ else if (strstr(extensions, "GLX_SGI_swap_control"))  swap_interval = (void*)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalSGI");
+ if (swap_interval) swap_interval(1);
+}
+
+
+// Changes the radius of the brightness/contrast adjustment, and redoes it from the moment tables.
+void set_local_range(int range) {
+ int max = (image_width > image_height ? image_width : image_height) / 8;
+ if (range > max) range = max;
+ if (range < 1)   range = 1;
+ if (range == local_range || finished_everything) return;
+ if (loading) { // the full image will be done at the new radius
+  local_range = range;
+  full_next_row = 0;
+  printf("Radius: %d pixels\n", local_range);
+  return;
+ }
+ if (!stats && !gpu_stats && !source) return;
+ local_range = range;
+ int t = glutGet(GLUT_ELAPSED_TIME);
+ upload_normalised();
+ glFinish();
+ printf("Radius: %d pixels (%d ms)\n", local_range, glutGet(GLUT_ELAPSED_TIME) - t);
+ redraw_for_input();
+}
+void grow_local_range()   { set_local_range(local_range*5/4 > local_range ? local_range*5/4 : local_range+1); }
+void shrink_local_range() { set_local_range(local_range*4/5 < local_range ? local_range*4/5 : local_range-1); }
+
+
 void reshape_window(int width, int height) {
  glViewport(0, 0, (GLint) width, (GLint) height);
  _viewport_x = width;
@@ -535,11 +3129,21 @@ void reshape_window(int width, int height) {
 void mouse_motion(int x, int y) {
  static int last_x = -1;  if (last_x == -1) last_x = x;
  static int last_y = -1;  if (last_y == -1) last_y = y;
- if (selected_crop_point >= 0) {
+ static int last_selected = -1;
+ mouse_x = x;
+ mouse_y = y;
+ if (selected_crop_point >= 0 && selected_crop_point == last_selected && show_loupe) {
+  // with the loupe, a corner that's been picked up moves as far as the mouse does in the loupe, for fine adjustment
+  crop_points[selected_crop_point].x += (float)(x - last_x) / loupe_zoom;
+  crop_points[selected_crop_point].y += (float)(y - last_y) / loupe_zoom;
+  update_crop();
+  redraw_for_input();
+ }
+ else if (selected_crop_point >= 0) {
   vec2 v; v.x=x; v.y=y;
   crop_points[selected_crop_point] = wpc2ipc(v);
-  recalc_crop_aspect();
-  draw();
+  update_crop();
+  redraw_for_input();
  }
  else if (selected_crop_point == -16) {
   float dx = (x - last_x) * wpc2ipc_scale;
@@ -550,14 +3154,25 @@ void mouse_motion(int x, int y) {
    crop_points[i].x += dx;
    crop_points[i].y += dy;   
   }
-  draw();
+  update_crop();
+  redraw_for_input();
  }
+ else if (show_loupe) redraw_for_input();
  last_x = x;
  last_y = y;
+ last_selected = selected_crop_point;
+}
+
+void mouse_entry(int state) {
+ if (state == GLUT_LEFT) { mouse_x = mouse_y = -1;  glutPostRedisplay(); } // (takes the loupe away)
 }
 
 
 void mouse_func(int button, int state, int x, int y) {
+ if (button==3 || button==4) { // mouse wheel
+  if (state==GLUT_DOWN) { if (button==3) grow_local_range(); else shrink_local_range(); }
+  return;
+ }
  if (state==GLUT_DOWN) {
   if (button==GLUT_LEFT_BUTTON) {
    vec2 v; v.x=x; v.y=y;
@@ -592,7 +3207,7 @@ void key_down(unsigned char key, int x, int y) {
    crop_points[2] = crop_points[1];
    crop_points[1] = crop_points[0];
    crop_points[0] = v;
-   recalc_crop_aspect(); draw();
+   update_crop(); redraw_for_input();
   break;
   case '>':case '.':
    v = crop_points[0];
@@ -600,10 +3215,16 @@ void key_down(unsigned char key, int x, int y) {
    crop_points[1] = crop_points[2];
    crop_points[2] = crop_points[3];
    crop_points[3] = v;
-   recalc_crop_aspect(); draw();
+   update_crop(); redraw_for_input();
   break;
-  case '\b': reset_crop_points(); recalc_crop_aspect(); draw(); break;
-  case '\r': save_and_quit = 1; recalc_crop_aspect(); draw(); break;
+  case '+':case '=': grow_local_range();   break;
+  case '-':case '_': shrink_local_range(); break;
+  case '\b': reset_crop_points(); update_crop(); redraw_for_input(); break;
+  case '\r': save_and_quit = 1; update_crop(); redraw_for_input(); break;
+  case 'h':case 'H': show_hud = !show_hud; redraw_for_input(); break;
+  case 'z':case 'Z': show_loupe = !show_loupe; mouse_x = x; mouse_y = y; redraw_for_input(); break;
+  case '[': if (loupe_zoom > 1)  loupe_zoom /= 2; redraw_for_input(); break;
+  case ']': if (loupe_zoom < 64) loupe_zoom *= 2; redraw_for_input(); break;
   case 27: exit(0); break;
  }
 }
@@ -617,20 +3238,86 @@ void key_up(unsigned char key, int x, int y) {
 
 int main(int argc, char **argv)
 {
- if (argc != 2) {
+ const char *simd_name = NULL;
+ const char *headless_output = NULL;
+ const char *batch_dir = NULL, *batch_list = NULL;
+ const char *inputs[argc];
+ int input_count = 0;
+ vec2 *c = start_crop_points;
+ for (int i=1; i<argc; i++) {
+  if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) && i+1 < argc) num_threads = atoi(argv[++i]);
+  else if (!strcmp(argv[i], "--simd") && i+1 < argc) simd_name = argv[++i];
+  else if (!strcmp(argv[i], "--stream")) stream_input = 1;
+  else if (!strcmp(argv[i], "--half")) half_floats = 1;
+  else if (!strcmp(argv[i], "--gpu")) use_gpu = 1;
+  else if (!strcmp(argv[i], "--no-detect")) detect_page = 0;
+  else if (!strcmp(argv[i], "--check-gpu")) use_gpu = check_gpu = 1;
+  else if (!strcmp(argv[i], "--stats-scale") && i+1 < argc) stats_scale = atoi(argv[++i]);
+  else if (!strcmp(argv[i], "--tile-size") && i+1 < argc) tile_size = atoi(argv[++i]);
+  else if ((!strcmp(argv[i], "-r") || !strcmp(argv[i], "--radius")) && i+1 < argc) local_range = atoi(argv[++i]);
+  else if ((!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) && i+1 < argc) headless_output = argv[++i];
+  else if (!strcmp(argv[i], "--crop") && i+1 < argc) { // corners 1-4, as in the window: top left, top right, bottom right, bottom left
+   crop_given = sscanf(argv[++i], "%f,%f,%f,%f,%f,%f,%f,%f", &c[3].x, &c[3].y, &c[2].x, &c[2].y, &c[1].x, &c[1].y, &c[0].x, &c[0].y) == 8;
+   if (!crop_given) { input_count = -1; break; }
+  }
+  else if (!strcmp(argv[i], "--bilinear")) bilinear_only = 1;
+  else if (!strcmp(argv[i], "--anisotropy") && i+1 < argc) anisotropy = atoi(argv[++i]);
+  else if (!strcmp(argv[i], "--check-warp")) check_warp = 1;
+  else if (!strcmp(argv[i], "--shaders")) use_shaders = 1;
+  else if (!strcmp(argv[i], "--frame-times")) show_frame_times = 1;
+  else if (!strcmp(argv[i], "--hud")) show_hud = 1;
+  else if (!strcmp(argv[i], "--no-pane-cache")) use_pane_cache = 0;
+  else if (!strcmp(argv[i], "--view-size") && i+1 < argc) view_size = atoi(argv[++i]);
+  else if (!strcmp(argv[i], "--batch") && i+1 < argc) batch_dir = argv[++i];
+  else if (!strcmp(argv[i], "--list") && i+1 < argc) batch_list = argv[++i];
+  else inputs[input_count++] = argv[i];
+ }
+ if (input_count == 1 && !batch_dir) input_filename = inputs[0];
+ if (batch_dir && input_count >= 0) {
+  for (int i=0; i<input_count; i++) if (!add_batch_item(inputs[i], NULL)) { printf("Not enough memory.\n"); return 1; }
+  if (batch_list && !read_batch_list(batch_list)) {
+   printf("Couldn't read the list %s\n", batch_list);
+   return 1;
+  }
+  if (crop_given) for (int i=0; i<batch_count; i++) if (!batch_items[i].crop_given) {
+   memcpy(batch_items[i].crop, start_crop_points, sizeof(start_crop_points));
+   batch_items[i].crop_given = 1;
+  }
+ }
+ if (!input_filename && !batch_count) {
   update_output_filename();
-  printf("This program is for enhancing photos of papers, to make them printable.\nIt auto-adjusts contrast and allows you to crop in perspective.\n\nUsage: %s <input image file name>\n\nOutput filename will be automatically generated,\nfor example '%s'\n", argv[0], output_filename);
+  printf("This program is for enhancing photos of papers, to make them printable.\nIt auto-adjusts contrast and allows you to crop in perspective.\n\nUsage: %s [-r radius] [--stats-scale n] [--stream] [--half] [--gpu] [--check-gpu] [--tile-size n] [-t threads] [--simd generic|sse2|avx2|avx512]\n       [-o output.png] [--crop x1,y1,x2,y2,x3,y3,x4,y4] [--no-detect] [--bilinear] [--anisotropy n] [--check-warp]\n       [--shaders] [--no-pane-cache] [--frame-times] [--hud] [--view-size n] <input image file name>\n   or: %s --batch output-folder [options] [--list file] [input image file names...]\n\nOutput filename will be automatically generated,\nfor example '%s'\n(or with -o, it's saved straight there, without a window)\n", argv[0], argv[0], output_filename);
   return 1;
  }
- input_filename = argv[1];
+ if (!select_kernels(simd_name)) {
+  printf("SIMD kernels '%s' aren't available on this computer.\n", simd_name);
+  return 1;
+ }
+ if (batch_dir) { // one image per thread, rather than the worker pool
+  int jobs = num_threads > 0 ? num_threads : cpu_cores();
+  num_threads = 1;
+  printf("Using %s kernels\n", kernels->name);
+  return run_batch(batch_dir, jobs) ? 1 : 0;
+ }
+ start_workers();
+ printf("Using %s kernels, %d threads\n", kernels->name, num_threads);
+ if (headless_output) return save_headless(headless_output) ? 0 : 1;
+ if (view_size && use_gpu) {
+  printf("--view-size doesn't work with --gpu (the graphics card needs the whole image); ignoring it.\n");
+  view_size = 0;
+ }
+ if (view_size && stream_input)
+  printf("With --stream there are no moment tables to make the loupe's tiles from, so it will show the image shrunk to --view-size.\n");
  glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE);
  glutInitWindowSize(DEFAULT_WINDOW_WIDTH, DEFAULT_WINDOW_HEIGHT);
  glutInit(&argc, argv);
  glutCreateWindow("Clean up a photo of a paper");
+ set_vsync();
  glutReshapeFunc(reshape_window);
  glutMouseFunc(mouse_func);
  glutMotionFunc(mouse_motion);
  glutPassiveMotionFunc(mouse_motion);
+ glutEntryFunc(mouse_entry);
  glutKeyboardFunc(key_down);
  glutKeyboardUpFunc(key_up);
  glutDisplayFunc(draw);